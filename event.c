@@ -0,0 +1,93 @@
+/*
+ * event.c
+ */
+
+#include "rtos.h"
+#include "futex.h"
+#include "green.h"
+
+// futex bitset of a flag mask, waiters sleep on the bits they wait for and a set only wakes those
+static unsigned int event_bitset(unsigned long long bits)
+{
+    return (unsigned int)bits | (unsigned int)(bits >> 32);
+}
+
+static int event_match(unsigned long long flags, unsigned long long bits, int mode)
+{
+    return mode & OS_EVENT_ALL ? (flags & bits) == bits : (flags & bits) != 0;
+}
+
+void os_event_init(OS_EVENT *ev)
+{
+    ev->flags = 0;
+    ev->seq = 0;
+    ev->waiters = 0;
+}
+
+unsigned long long os_event_set(OS_EVENT *ev, unsigned long long bits)
+{
+    unsigned long long old = __atomic_fetch_or(&ev->flags, bits, __ATOMIC_SEQ_CST);
+    unsigned long long changed = bits & ~old;
+
+    // bits already set cannot satisfy anyone still waiting
+    if (changed && __atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST))
+    {
+        __atomic_fetch_add(&ev->seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&ev->seq, INT_MAX, event_bitset(changed));
+        green_futex_wake((const void *)&ev->seq);
+    }
+    return old;
+}
+
+unsigned long long os_event_clear(OS_EVENT *ev, unsigned long long bits)
+{
+    return __atomic_fetch_and(&ev->flags, ~bits, __ATOMIC_SEQ_CST);
+}
+
+unsigned long long os_event_get(OS_EVENT *ev)
+{
+    return __atomic_load_n(&ev->flags, __ATOMIC_ACQUIRE);
+}
+
+int os_event_wait(OS_EVENT *ev, unsigned long long bits, int mode, int timeout_ms, unsigned long long *res)
+{
+    unsigned long long deadline = timeout_ms > 0 ? os_get_nsec_clock() + timeout_ms * 1000000ULL : 0;
+    unsigned long long flags;
+    unsigned int seq;
+
+    if (bits == 0)
+        return IO_ERR;
+    flags = __atomic_load_n(&ev->flags, __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        if (event_match(flags, bits, mode))
+        {
+            // a failed exchange reloads flags, another waiter may have taken them
+            if ((mode & OS_EVENT_CLEAR) &&
+                !__atomic_compare_exchange_n(&ev->flags, &flags, flags & ~bits, 0, __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+                continue;
+            if (res)
+                *res = flags;
+            return IO_OK;
+        }
+        if (deadline && os_get_nsec_clock() >= deadline)
+            break;
+        // count in before reading the flags, a set either is seen here or sees the waiter
+        __atomic_fetch_add(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST);
+        flags = __atomic_load_n(&ev->flags, __ATOMIC_SEQ_CST);
+        if (!event_match(flags, bits, mode))
+        {
+            if (green_active())
+                green_futex_wait(&ev->seq, seq, deadline);
+            else
+                futex_wait(&ev->seq, seq, deadline, event_bitset(bits));
+            flags = __atomic_load_n(&ev->flags, __ATOMIC_ACQUIRE);
+        }
+        __atomic_fetch_sub(&ev->waiters, 1, __ATOMIC_RELAXED);
+    }
+    if (res)
+        *res = flags;
+    return IO_TIMEOUT;
+}
@@ -1,341 +1,520 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "fifo.h"
+#include "futex.h"
+#include "green.h"
 
 // #define FIFO_DEB 1
 #define cpmem memcpy
 #define zmem(p, sz) memset((p), 0, (sz))
 
-#define ATOMIC_PTR (ATOMIC_UINT *)
-
 #define CACHE_FLUSH(a, b, c)
 #define CACHE_INVALIDATE(a, b, c)
 
-#ifdef USE_ATOMIC_MEM
-#define MUTEX_LOCK(x)
-#define MUTEX_UNLOCK(x)
-#else
-#define MUTEX_LOCK() sys_MutexLock(fifo->mutex)
-#define MUTEX_UNLOCK() sys_MutexUnlock(fifo->mutex)
-#endif
+#define FIFO_SLOT_FREE (~0ULL)
+#define FIFO_SLOT_BUSY (~1ULL)
 
-static __inline unsigned int fifo_atomic_inc(ATOMIC_UINT *pmem, int delta)
+static __inline unsigned long long fifo_index(const Fifo *fifo, unsigned long long pos)
 {
-    unsigned int t;
-#ifdef USE_ATOMIC_MEM
-    if (delta >= 0)
-        t = __atomic_fetch_add(pmem, delta, USE_ATOMIC_MEM);
+    return fifo->mask ? pos & fifo->mask : pos % fifo->limit;
+}
+
+static __inline void fifo_make_span(const Fifo *fifo, unsigned long long pos, unsigned int len, IO_SPAN *span)
+{
+    unsigned long long idx = fifo_index(fifo, pos);
+    span->ptr[0] = fifo->buf + idx;
+    span->ptr[1] = fifo->buf;
+    if (!fifo->mirror && idx + len > fifo->limit)
+        span->len[1] = (unsigned int)(idx + len - fifo->limit);
     else
-        t = __atomic_fetch_sub(pmem, -delta, USE_ATOMIC_MEM);
-#else
-    t = *pmem;
-    *(ATOMIC_UINT *)pmem += delta;
-#endif
-    return t;
+        span->len[1] = 0;
+    span->len[0] = len - span->len[1];
+    span->pos = pos;
 }
 
-static __inline unsigned int fifo_atomic_set(ATOMIC_UINT *pmem, unsigned int val)
+unsigned long long fifo_GetDataLen(const Fifo *fifo)
 {
-    unsigned int t;
-#ifdef USE_ATOMIC_MEM
-    __atomic_exchange(pmem, &val, &t, USE_ATOMIC_MEM);
-#else
-    t = *pmem;
-    *pmem = val;
-#endif
-    return t;
+    unsigned long long rd = __atomic_load_n(&fifo->rd_tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&fifo->wr_tail, __ATOMIC_ACQUIRE) - rd;
 }
 
-static __inline unsigned int fifo_atomic_get(ATOMIC_UINT *pmem)
+unsigned long long fifo_GetFreeLen(const Fifo *fifo)
 {
-#ifdef USE_ATOMIC_MEM
-    unsigned int t;
-    __atomic_load(pmem, &t, USE_ATOMIC_MEM);
-    return t;
-#else
-    return *pmem;
-#endif
+    unsigned long long rd = __atomic_load_n(&fifo->rd_tail, __ATOMIC_ACQUIRE);
+    return fifo->limit - (__atomic_load_n(&fifo->wr_head, __ATOMIC_RELAXED) - rd);
 }
 
-static __inline unsigned int fifo_atomic_sum(ATOMIC_UINT *pmem1, ATOMIC_UINT *pmem2)
+unsigned int fifo_WriteReserve(Fifo *fifo, unsigned int len, IO_SPAN *span)
 {
-#ifdef USE_ATOMIC_MEM
-    unsigned int t1 = 0, t2 = 0;
-    unsigned int t1_prev, t2_prev;
+    unsigned long long wr, rd;
+
+    wr = __atomic_load_n(&fifo->wr_head, __ATOMIC_RELAXED);
     do
     {
-        t1_prev = t1;
-        t2_prev = t2;
-        __atomic_load(pmem1, &t1, USE_ATOMIC_MEM);
-        __atomic_load(pmem2, &t2, USE_ATOMIC_MEM);
+        // readers must be done with the space before it is reused
+        rd = __atomic_load_n(&fifo->rd_tail, __ATOMIC_ACQUIRE);
+        if (len > fifo->limit - (wr - rd))
+        {
+            __atomic_fetch_add(&fifo->overflow_cnt, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
     }
-    while (t1 != t1_prev || t2 != t2_prev);
-    return t1 + t2;
-#else
-    unsigned int t = *pmem1 + *pmem2;
-    return t;
-#endif
+    while (!__atomic_compare_exchange_n(&fifo->wr_head, &wr, wr + len, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    fifo_make_span(fifo, wr, len, span);
+    return len;
 }
 
-unsigned int fifo_GetDataLen(const Fifo *fifo)
+// Count in as a waiter, the caller then checks its condition and calls fifo_wait_end
+static unsigned int fifo_wait_begin(Fifo *fifo)
 {
-    return fifo_atomic_get(ATOMIC_PTR & fifo->size);
+    __atomic_fetch_add(&fifo->wr_waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&fifo->wr_seq, __ATOMIC_SEQ_CST);
 }
 
-unsigned int fifo_GetFreeLen(const Fifo *fifo)
+static void fifo_wait_end(Fifo *fifo, unsigned int seq, int sleep)
 {
-    unsigned int ret;
-    MUTEX_LOCK();
-    ret = (fifo->limit - fifo_atomic_sum(ATOMIC_PTR & fifo->size, ATOMIC_PTR & fifo->wr_size));
-    MUTEX_UNLOCK();
-    return ret;
+    if (sleep)
+    {
+        if (green_active())
+            green_futex_wait(&fifo->wr_seq, seq, 0);
+        else
+            futex_wait(&fifo->wr_seq, seq, 0, FUTEX_BITSET_MATCH_ANY);
+    }
+    __atomic_fetch_sub(&fifo->wr_waiters, 1, __ATOMIC_RELAXED);
 }
 
-unsigned int fifo_InsBlock(Fifo *fifo, const void *pData, unsigned int len)
+// after a seq_cst change a waiter may be sleeping on, costs a load while nobody waits
+static void fifo_wake(Fifo *fifo)
 {
-    unsigned int wrIdx;
-    unsigned char *wrPtr;
-    unsigned int i0, i1;
-    unsigned char *beg = (unsigned char *)(fifo + 1);
+    if (__atomic_load_n(&fifo->wr_waiters, __ATOMIC_SEQ_CST))
+    {
+        __atomic_fetch_add(&fifo->wr_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&fifo->wr_seq, INT_MAX, FUTEX_BITSET_MATCH_ANY);
+        green_futex_wake((const void *)&fifo->wr_seq);
+    }
+}
 
-    MUTEX_LOCK();
-    if (len > (fifo->limit - fifo_atomic_sum(ATOMIC_PTR & fifo->size, ATOMIC_PTR & fifo->wr_size)))
+static int fifo_slot_free(Fifo *fifo)
+{
+    int i;
+    for (i = 0; i < FIFO_COMMIT_SLOTS; i++)
     {
-        fifo->overflow_cnt++;
-        MUTEX_UNLOCK();
-        return 0;
+        if (__atomic_load_n(&fifo->wr_slots[i].start, __ATOMIC_SEQ_CST) == FIFO_SLOT_FREE)
+            return 1;
     }
-    fifo_atomic_inc(ATOMIC_PTR & fifo->wr_cnt, 1);
-    fifo_atomic_inc(ATOMIC_PTR & fifo->wr_size, (int)len);
-    wrIdx = fifo_atomic_inc(ATOMIC_PTR & fifo->wrIdx, (int)len);
-    MUTEX_UNLOCK();
-    wrIdx %= fifo->limit;
-
-    wrPtr = wrIdx + beg;
-    if (wrIdx + len >= fifo->limit)
-        i0 = wrIdx + len - fifo->limit;
-    else
-        i0 = 0;
-    if (pData)
+    return 0;
+}
+
+// take over a finished reservation starting at pos, returns its end or FIFO_SLOT_FREE
+static unsigned long long fifo_unpark(Fifo *fifo, unsigned long long pos)
+{
+    int i;
+    unsigned long long end;
+    for (i = 0; i < FIFO_COMMIT_SLOTS; i++)
     {
-        cpmem(wrPtr, pData, i1 = len - i0);
-        CACHE_FLUSH(wrPtr, i1, fifo);
-        if (i0)
+        FifoCommitSlot *sl = &fifo->wr_slots[i];
+        unsigned long long t = pos;
+        if (__atomic_load_n(&sl->start, __ATOMIC_RELAXED) == pos &&
+            __atomic_compare_exchange_n(&sl->start, &t, FIFO_SLOT_BUSY, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
         {
-            cpmem(beg, (const char *)pData + i1, i0);
-            CACHE_FLUSH(beg, i0, fifo);
+            end = sl->end;
+            __atomic_fetch_sub(&fifo->wr_parked, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&sl->start, FIFO_SLOT_FREE, __ATOMIC_SEQ_CST);
+            fifo_wake(fifo);
+            return end;
         }
     }
-    MUTEX_LOCK();
-    i1 = fifo_atomic_inc(ATOMIC_PTR & fifo->wr_cnt, -1);
-    if (i1 - 1 == 0)
+    return FIFO_SLOT_FREE;
+}
+
+// Reservations are published in order. A writer finishing ahead of an earlier
+// one parks its range in a slot and returns, the earlier writer publishes it.
+void fifo_WriteCommit(Fifo *fifo, const IO_SPAN *span)
+{
+    unsigned long long start = span->pos;
+    unsigned long long end = start + span->len[0] + span->len[1];
+    unsigned long long t, free_slot;
+    FifoCommitSlot *sl;
+    unsigned int seq;
+    int i;
+
+    CACHE_FLUSH(span->ptr[0], span->len[0], fifo);
+    CACHE_FLUSH(span->ptr[1], span->len[1], fifo);
+    for (;;)
     {
-        i1 = fifo_atomic_set(ATOMIC_PTR & fifo->wr_size, 0);
-        fifo_atomic_inc(ATOMIC_PTR & fifo->size, (int)i1);
+        t = start;
+        if (__atomic_compare_exchange_n(&fifo->wr_tail, &t, end, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            if (__atomic_load_n(&fifo->wr_parked, __ATOMIC_SEQ_CST) == 0)
+                break;
+            start = end;
+            end = fifo_unpark(fifo, start);
+            if (end == FIFO_SLOT_FREE)
+                break;
+            continue;
+        }
+
+        // an earlier reservation is not committed yet
+        sl = NULL;
+        for (i = 0; i < FIFO_COMMIT_SLOTS && sl == NULL; i++)
+        {
+            free_slot = FIFO_SLOT_FREE;
+            if (__atomic_compare_exchange_n(&fifo->wr_slots[i].start, &free_slot, FIFO_SLOT_BUSY, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                sl = &fifo->wr_slots[i];
+        }
+        if (sl == NULL)
+        {
+            // every slot holds a later range, sleep until the tail reaches us or a slot comes free
+            seq = fifo_wait_begin(fifo);
+            fifo_wait_end(fifo, seq,
+                          __atomic_load_n(&fifo->wr_tail, __ATOMIC_SEQ_CST) != start && !fifo_slot_free(fifo));
+            continue;
+        }
+        sl->end = end;
+        __atomic_fetch_add(&fifo->wr_parked, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&sl->start, start, __ATOMIC_SEQ_CST);
+        // the earlier writer may have finished before it could see the slot
+        if (__atomic_load_n(&fifo->wr_tail, __ATOMIC_SEQ_CST) != start)
+            return;
+        t = start;
+        if (!__atomic_compare_exchange_n(&sl->start, &t, FIFO_SLOT_BUSY, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return;  // already taken over
+        __atomic_fetch_sub(&fifo->wr_parked, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&sl->start, FIFO_SLOT_FREE, __ATOMIC_SEQ_CST);
+        fifo_wake(fifo);
     }
-    MUTEX_UNLOCK();
+    // the tail moved, a writer waiting for a slot may be next in line now
+    fifo_wake(fifo);
+}
+
+// copy len bytes to the span region starting at offset off
+void fifo_SpanWrite(const IO_SPAN *span, unsigned int off, const void *pData, unsigned int len)
+{
+    unsigned int i1;
+    if (off < span->len[0])
+    {
+        i1 = span->len[0] - off;
+        if (i1 > len)
+            i1 = len;
+        cpmem((unsigned char *)span->ptr[0] + off, pData, i1);
+        pData = (const unsigned char *)pData + i1;
+        len -= i1;
+        off = 0;
+    }
+    else
+    {
+        off -= span->len[0];
+    }
+    if (len)
+        cpmem((unsigned char *)span->ptr[1] + off, pData, len);
+}
+
+// copy len bytes from the span region starting at offset off
+void fifo_SpanRead(const IO_SPAN *span, unsigned int off, void *pBuf, unsigned int len)
+{
+    unsigned int i1;
+    if (off < span->len[0])
+    {
+        i1 = span->len[0] - off;
+        if (i1 > len)
+            i1 = len;
+        cpmem(pBuf, (const unsigned char *)span->ptr[0] + off, i1);
+        pBuf = (unsigned char *)pBuf + i1;
+        len -= i1;
+        off = 0;
+    }
+    else
+    {
+        off -= span->len[0];
+    }
+    if (len)
+        cpmem(pBuf, (const unsigned char *)span->ptr[1] + off, len);
+}
+
+unsigned int fifo_InsBlock(Fifo *fifo, const void *pData, unsigned int len)
+{
+    IO_SPAN span;
+
+    if (!fifo_WriteReserve(fifo, len, &span))
+        return 0;
+    if (pData)
+        fifo_SpanWrite(&span, 0, pData, len);
+    fifo_WriteCommit(fifo, &span);
     return len;
 }
 
 unsigned int fifo_InsBlocks(Fifo *fifo, const void **pData, const unsigned int *plen, int cnt)
 {
     int i;
-    unsigned int wrIdx;
-    unsigned char *wrPtr;
-    unsigned int i0, i1;
-    unsigned char *beg = (unsigned char *)(fifo + 1);
+    IO_SPAN span;
+    unsigned int off = 0;
     unsigned int len = 0;
     for (i = 0; i < cnt; i++)
     {
         len += plen[i];
     }
-    MUTEX_LOCK();
-    if (len > (fifo->limit - fifo_atomic_sum(ATOMIC_PTR & fifo->size, ATOMIC_PTR & fifo->wr_size)))
-    {
-        fifo->overflow_cnt++;
-        MUTEX_UNLOCK();
+    if (!fifo_WriteReserve(fifo, len, &span))
         return 0;
-    }
-    fifo_atomic_inc(ATOMIC_PTR & fifo->wr_cnt, 1);
-    fifo_atomic_inc(ATOMIC_PTR & fifo->wr_size, (int)len);
-    wrIdx = fifo_atomic_inc(ATOMIC_PTR & fifo->wrIdx, (int)len);
-    MUTEX_UNLOCK();
-    wrIdx %= fifo->limit;
 
     for (i = 0; i < cnt; i++)
     {
-        wrPtr = wrIdx + beg;
-        if (wrIdx + plen[i] >= fifo->limit)
-            i0 = wrIdx + plen[i] - fifo->limit;
-        else
-            i0 = 0;
         if (pData[i])
-        {
-            cpmem(wrPtr, pData[i], i1 = plen[i] - i0);
-            CACHE_FLUSH(wrPtr, i1, fifo);
-            if (i0)
-            {
-                cpmem(beg, (char *)pData[i] + i1, i0);
-                CACHE_FLUSH(beg, i0, fifo);
-            }
-        }
-        wrIdx += plen[i];
-        if (wrIdx >= fifo->limit)
-        {
-            wrIdx -= fifo->limit;
-        }
+            fifo_SpanWrite(&span, off, pData[i], plen[i]);
+        off += plen[i];
     }
-    MUTEX_LOCK();
-    i1 = fifo_atomic_inc(ATOMIC_PTR & fifo->wr_cnt, -1);
-    if (i1 - 1 == 0)
-    {
-        i1 = fifo_atomic_set(ATOMIC_PTR & fifo->wr_size, 0);
-        fifo_atomic_inc(ATOMIC_PTR & fifo->size, (int)i1);
-    }
-    MUTEX_UNLOCK();
+    fifo_WriteCommit(fifo, &span);
 
     return len;
 }
 
-unsigned int fifo_ExtrBlock(Fifo *fifo, void *pBuf, unsigned int len)
+unsigned int fifo_ReadPeek(Fifo *fifo, unsigned int len, IO_SPAN *span)
 {
-    unsigned char *rdPtr;
-    unsigned int i0, i1;
-    unsigned int size;
-
-    unsigned int rdIdx;
-    unsigned char *beg = (unsigned char *)(fifo + 1);
+    unsigned long long rd;
+    unsigned long long size;
 
-    MUTEX_LOCK();
-    size = fifo_atomic_get(ATOMIC_PTR & fifo->size);
+    rd = __atomic_load_n(&fifo->rd_tail, __ATOMIC_RELAXED);
+    size = __atomic_load_n(&fifo->wr_tail, __ATOMIC_ACQUIRE) - rd;
     if (len > size)
     {
-        len = size;
+        len = (unsigned int)size;
     }
     if (len == 0)
     {
-        MUTEX_UNLOCK();
         return 0;
     }
-    i1 = fifo_atomic_inc(ATOMIC_PTR & fifo->rd_size, (int)len);
-    if (i1)
+    // the reader owns the read position until fifo_ReadRelease,
+    // the claim fails while another reader is in progress
+    if (!__atomic_compare_exchange_n(&fifo->rd_head, &rd, rd + len, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
     {
-        fifo_atomic_inc(ATOMIC_PTR & fifo->rd_size, -(int)len);
-        MUTEX_UNLOCK();
+        __atomic_fetch_add(&fifo->rd_contention, 1, __ATOMIC_RELAXED);
         return 0;
     }
-    rdIdx = fifo_atomic_inc(ATOMIC_PTR & fifo->rdIdx, (int)len);
-    MUTEX_UNLOCK();
-    rdIdx %= fifo->limit;
-    rdPtr = rdIdx + beg;
 
-    if (rdIdx + len >= fifo->limit)
-        i0 = rdIdx + len - fifo->limit;
-    else
-        i0 = 0;
+    fifo_make_span(fifo, rd, len, span);
+    CACHE_INVALIDATE(span->ptr[0], span->len[0], fifo);
+    CACHE_INVALIDATE(span->ptr[1], span->len[1], fifo);
+    return len;
+}
+
+void fifo_ReadRelease(Fifo *fifo, const IO_SPAN *span, unsigned int len)
+{
+    unsigned int peek_len = span->len[0] + span->len[1];
+    if (len > peek_len)
+        len = peek_len;
+
+    __atomic_store_n(&fifo->rd_head, span->pos + len, __ATOMIC_RELAXED);
+    __atomic_store_n(&fifo->rd_tail, span->pos + len, __ATOMIC_RELEASE);
+}
+
+unsigned int fifo_ExtrBlock(Fifo *fifo, void *pBuf, unsigned int len)
+{
+    IO_SPAN span;
+
+    len = fifo_ReadPeek(fifo, len, &span);
+    if (len == 0)
+        return 0;
 
     if (pBuf)
     {
-        CACHE_INVALIDATE(rdPtr, i1, fifo);
-        cpmem(pBuf, rdPtr, i1 = len - i0);
-        if (i0)
-        {
-            CACHE_INVALIDATE(beg, i0, fifo);
-            cpmem((char *)pBuf + i1, beg, i0);
-        }
+        cpmem(pBuf, span.ptr[0], span.len[0]);
+        if (span.len[1])
+            cpmem((char *)pBuf + span.len[0], span.ptr[1], span.len[1]);
     }
 
-    MUTEX_LOCK();
-    fifo_atomic_inc(ATOMIC_PTR & fifo->size, -(int)len);
-    fifo_atomic_inc(ATOMIC_PTR & fifo->rd_size, -(int)len);
-    MUTEX_UNLOCK();
+    fifo_ReadRelease(fifo, &span, len);
     return (len);
 }
 
-unsigned int fifo_InsBlock_Box(Fifo *fifo, const void *pData, unsigned int len)
+// Extract as many whole blocks as are available with one read claim,
+// returns the number of bytes extracted
+unsigned int fifo_ExtrBlocks(Fifo *fifo, void **pBuf, const unsigned int *plen, int cnt)
 {
-    unsigned int wrIdx;
-    unsigned int i1;
-    unsigned char *beg = (unsigned char *)(fifo + 1);
-
-    MUTEX_LOCK();
-    i1 = fifo_atomic_set(ATOMIC_PTR & fifo->wr_cnt, 1);
-    if (i1)
+    int i;
+    IO_SPAN span;
+    unsigned int off = 0;
+    unsigned int len = 0;
+    for (i = 0; i < cnt; i++)
     {
-        // write is in progress
-        MUTEX_UNLOCK();
+        len += plen[i];
+    }
+    len = fifo_ReadPeek(fifo, len, &span);
+    if (len == 0)
         return 0;
+
+    for (i = 0; i < cnt && off + plen[i] <= len; i++)
+    {
+        if (pBuf[i])
+            fifo_SpanRead(&span, off, pBuf[i], plen[i]);
+        off += plen[i];
     }
-    wrIdx = fifo_atomic_get(ATOMIC_PTR & fifo->rdIdx);
-    MUTEX_UNLOCK();
-    wrIdx %= fifo->limit;
-    wrIdx += fifo->limit / 2;
-    if (wrIdx >= fifo->limit)
-        wrIdx -= fifo->limit;
+    fifo_ReadRelease(fifo, &span, off);
+    return off;
+}
+
+#define FIFO_BOX_SEQ(f, t) ((volatile unsigned long long *)((f)->buf + ((t) % (f)->box_cnt) * (f)->box_slot))
 
+unsigned long long fifo_BoxBufSize(unsigned int cnt, unsigned int size)
+{
+    return (unsigned long long)cnt * (sizeof(unsigned long long) + ((size + 7ULL) & ~7ULL));
+}
+
+// Every slot starts with a sequence, 2 * ticket + 1 while the write of ticket fills it, 2 * ticket + 2 once done
+void fifo_InitBox(Fifo *fifo, void *buf, unsigned int cnt, unsigned int size)
+{
+    unsigned int i;
+    fifo_InitFifo(fifo, buf, fifo_BoxBufSize(cnt, size));
+    fifo->box_cnt = cnt;
+    fifo->box_size = size;
+    fifo->box_slot = (unsigned int)fifo_BoxBufSize(1, size);
+    for (i = 0; i < cnt; i++)
+        *FIFO_BOX_SEQ(fifo, i) = 0;
+}
+
+unsigned int fifo_InsBlock_Box(Fifo *fifo, const void *pData, unsigned int len)
+{
+    unsigned long long t, seq, latest;
+    volatile unsigned long long *pseq;
+
+    if (len != fifo->box_size)
+        return 0;
+    for (;;)
+    {
+        t = __atomic_fetch_add(&fifo->box_ticket, 1, __ATOMIC_RELAXED);
+        pseq = FIFO_BOX_SEQ(fifo, t);
+        seq = __atomic_load_n(pseq, __ATOMIC_RELAXED);
+        while (!(seq & 1) && seq < 2 * t + 1 &&
+               !__atomic_compare_exchange_n(pseq, &seq, 2 * t + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            ;
+        if (!(seq & 1) && seq < 2 * t + 1)
+            break;
+        // a newer write took the slot while we stalled after taking our ticket, ours is stale already
+        if (seq >= 2 * t + 1)
+            return (len);
+        // a writer a lap behind still owns the slot, take the next one
+    }
     if (pData)
     {
-        cpmem(beg + wrIdx, pData, len);
-        CACHE_FLUSH(beg + wrIdx, len, fifo);
+        cpmem((unsigned char *)pseq + sizeof(*pseq), pData, len);
+        CACHE_FLUSH((unsigned char *)pseq + sizeof(*pseq), len, fifo);
     }
-    MUTEX_LOCK();
-    fifo_atomic_inc((ATOMIC_UINT *)&fifo->wr_size, (int)len);
-    fifo_atomic_set(&fifo->size, len);
-    fifo_atomic_set((ATOMIC_UINT *)&fifo->wr_cnt, 0);
-    MUTEX_UNLOCK();
+    __atomic_store_n(pseq, 2 * t + 2, __ATOMIC_RELEASE);
+
+    // a newer write may have finished first, never publish an older one over it
+    latest = __atomic_load_n(&fifo->box_latest, __ATOMIC_RELAXED);
+    while (latest < t + 1 &&
+           !__atomic_compare_exchange_n(&fifo->box_latest, &latest, t + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
     return (len);
 }
 
+// Copies the newest consistent element, the same one is returned until a newer write finishes.
+// Never waits for a writer, a slot taken again means a newer write started, so box_latest is read again.
 unsigned int fifo_ExtrBlock_Box(Fifo *fifo, void *pBuf, unsigned int len)
 {
-    unsigned int rdIdx;
-    unsigned int i1;
-    unsigned char *beg = (unsigned char *)(fifo + 1);
+    unsigned long long latest, seq;
+    volatile unsigned long long *pseq;
 
-    // len must be equal element size!
-    MUTEX_LOCK();
-    if (fifo_atomic_get(ATOMIC_PTR & fifo->size) < len)
-    {
-        // no data written yet
-        MUTEX_UNLOCK();
+    if (len < fifo->box_size)
         return 0;
+    for (;;)
+    {
+        latest = __atomic_load_n(&fifo->box_latest, __ATOMIC_ACQUIRE);
+        if (latest == 0)
+        {
+            // no data written yet
+            return 0;
+        }
+        pseq = FIFO_BOX_SEQ(fifo, latest - 1);
+        seq = __atomic_load_n(pseq, __ATOMIC_ACQUIRE);
+        if (seq != 2 * latest)
+            continue;
+        if (pBuf)
+        {
+            CACHE_INVALIDATE((unsigned char *)pseq + sizeof(*pseq), fifo->box_size, fifo);
+            cpmem(pBuf, (unsigned char *)pseq + sizeof(*pseq), fifo->box_size);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(pseq, __ATOMIC_RELAXED) == seq)
+            return fifo->box_size;
     }
-    i1 = fifo_atomic_inc(ATOMIC_PTR & fifo->rd_size, (int)len);
-    if (!i1 && !fifo_atomic_get(ATOMIC_PTR & fifo->wr_cnt) && fifo_atomic_set(ATOMIC_PTR & fifo->wr_size, 0))
+}
+
+unsigned int fifo_GetDataLen_Box(const Fifo *fifo)
+{
+    return __atomic_load_n(&fifo->box_latest, __ATOMIC_ACQUIRE) ? fifo->box_size : 0;
+}
+
+unsigned long long fifo_RoundPow2(unsigned long long size)
+{
+    unsigned long long p = 1;
+    while (p < size && p)
+        p <<= 1;
+    return p;
+}
+
+void fifo_InitFifo(Fifo *fifo, void *buf, unsigned long long size)
+{
+    int i;
+    zmem(fifo, sizeof(*fifo));
+    fifo->limit = size;
+    if (size && !(size & (size - 1)))
+        fifo->mask = size - 1;
+    fifo->buf = buf;
+    for (i = 0; i < FIFO_COMMIT_SLOTS; i++)
+        fifo->wr_slots[i].start = FIFO_SLOT_FREE;
+}
+
+// Map a memfd twice back to back, *size is rounded up to the page size.
+// Returns NULL if the mapping can't be created.
+void *fifo_MapMirror(unsigned long long *psize)
+{
+    int fd;
+    unsigned char *p;
+    unsigned long long page = (unsigned long long)sysconf(_SC_PAGESIZE);
+    unsigned long long size = (*psize + page - 1) / page * page;
+    size_t len = (size_t)size;
+
+    if (size == 0 || len != size || 2 * len < len)
+        return NULL;
+    fd = memfd_create("fifo", MFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, (off_t)len) != 0)
     {
-        rdIdx = fifo_atomic_inc(ATOMIC_PTR & fifo->rdIdx, (int)(fifo->limit / 2));
-        MUTEX_UNLOCK();
-        rdIdx %= fifo->limit;
-        rdIdx += fifo->limit / 2;
-        if (rdIdx >= fifo->limit)
-            rdIdx -= fifo->limit;
+        close(fd);
+        return NULL;
     }
-    else
+    p = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
     {
-        rdIdx = fifo_atomic_get(ATOMIC_PTR & fifo->rdIdx);
-        MUTEX_UNLOCK();
-        rdIdx %= fifo->limit;
+        close(fd);
+        return NULL;
     }
-
-    if (pBuf)
+    if (mmap(p, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(p + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
     {
-        CACHE_INVALIDATE(rdIdx + beg, len, fifo);
-        cpmem(pBuf, rdIdx + beg, len);
+        munmap(p, 2 * len);
+        close(fd);
+        return NULL;
     }
-    MUTEX_LOCK();
-    fifo_atomic_inc(ATOMIC_PTR & fifo->rd_size, -(int)len);
-    MUTEX_UNLOCK();
-
-    return (len);
+    close(fd);
+    *psize = size;
+    return p;
 }
 
-void fifo_InitFifo(Fifo *fifo, void *buf, unsigned int size)
+// Returns the ring size or 0 if the mapping can't be created.
+unsigned long long fifo_InitMirror(Fifo *fifo, unsigned long long size)
 {
-    (void)buf;
-    zmem(fifo, sizeof(*fifo));
-    fifo->limit = size;
-#ifndef USE_ATOMIC_MEM
-    fifo->mutex = sys_MutexCreate();
-#endif
+    void *p = fifo_MapMirror(&size);
+    if (p == NULL)
+        return 0;
+    fifo_InitFifo(fifo, p, size);
+    fifo->mirror = 1;
+    return size;
 }
@@ -9,35 +9,80 @@ extern "C"
 {
 #endif
 
-#define USE_ATOMIC_MEM __ATOMIC_SEQ_CST
+// writers finished ahead of an earlier one wait here to be published
+#define FIFO_COMMIT_SLOTS 8
 
-#define ATOMIC_UINT volatile unsigned int
+typedef struct
+{
+    volatile unsigned long long start;
+    volatile unsigned long long end;
+} FifoCommitSlot;
 
 typedef struct
 {
-    unsigned int limit;
-    ATOMIC_UINT size;
-    ATOMIC_UINT rdIdx;
-    ATOMIC_UINT rd_size;
-    ATOMIC_UINT wrIdx;
-    ATOMIC_UINT wr_cnt;
-    ATOMIC_UINT wr_size;
-#ifndef USE_ATOMIC_MEM
-    SYS_PMUTEX *mutex;
-#endif
+    unsigned long long limit;
+    unsigned long long mask;  // limit - 1 if limit is a power of two, else 0
+    union
+    {
+        struct
+        {
+            // reserve position
+            volatile unsigned long long wr_head;
+            // end of the data visible to readers
+            volatile unsigned long long wr_tail;
+            // read position claimed by the reader, differs from rd_tail while a read is in progress
+            volatile unsigned long long rd_head;
+            // end of the data released by the reader
+            volatile unsigned long long rd_tail;
+        };
+        // O_BOX mode
+        struct
+        {
+            // writes started, a write owns slot ticket % box_cnt
+            volatile unsigned long long box_ticket;
+            // ticket + 1 of the newest finished write, 0 while empty
+            volatile unsigned long long box_latest;
+            unsigned int box_cnt;
+            unsigned int box_size;
+            unsigned int box_slot;
+        };
+    };
+    volatile unsigned int wr_parked;
+    // writers out of commit slots wait for another writer on the wr_seq futex
+    volatile unsigned int wr_waiters;
+    volatile unsigned int wr_seq;
+    FifoCommitSlot wr_slots[FIFO_COMMIT_SLOTS];
+    unsigned char *buf;
+    // buf is mapped twice back to back, so no block is split at the ring end
+    unsigned char mirror;
     // for integrity check
     short id;
-    volatile unsigned short overflow_cnt;
+    volatile unsigned long long overflow_cnt;
+    // read claims lost to another reader
+    volatile unsigned long long rd_contention;
 } Fifo;
 
 unsigned int fifo_InsBlock(Fifo *fifo, const void *pData, unsigned int len);
 unsigned int fifo_InsBlocks(Fifo *fifo, const void **pData, const unsigned int *plen, int cnt);
+unsigned int fifo_WriteReserve(Fifo *fifo, unsigned int len, IO_SPAN *span);
+void fifo_WriteCommit(Fifo *fifo, const IO_SPAN *span);
 unsigned int fifo_ExtrBlock(Fifo *fifo, void *pBuf, unsigned int len);
-void fifo_InitFifo(Fifo *fifo, void *buf, unsigned int size);
-unsigned int fifo_GetDataLen(const Fifo *fifo);
-unsigned int fifo_GetFreeLen(const Fifo *fifo);
+unsigned int fifo_ExtrBlocks(Fifo *fifo, void **pBuf, const unsigned int *plen, int cnt);
+unsigned int fifo_ReadPeek(Fifo *fifo, unsigned int len, IO_SPAN *span);
+void fifo_ReadRelease(Fifo *fifo, const IO_SPAN *span, unsigned int len);
+void fifo_InitFifo(Fifo *fifo, void *buf, unsigned long long size);
+unsigned long long fifo_InitMirror(Fifo *fifo, unsigned long long size);
+void *fifo_MapMirror(unsigned long long *psize);
+void fifo_SpanWrite(const IO_SPAN *span, unsigned int off, const void *pData, unsigned int len);
+void fifo_SpanRead(const IO_SPAN *span, unsigned int off, void *pBuf, unsigned int len);
+unsigned long long fifo_RoundPow2(unsigned long long size);
+unsigned long long fifo_GetDataLen(const Fifo *fifo);
+unsigned long long fifo_GetFreeLen(const Fifo *fifo);
+unsigned long long fifo_BoxBufSize(unsigned int cnt, unsigned int size);
+void fifo_InitBox(Fifo *fifo, void *buf, unsigned int cnt, unsigned int size);
 unsigned int fifo_ExtrBlock_Box(Fifo *fifo, void *pBuf, unsigned int len);
 unsigned int fifo_InsBlock_Box(Fifo *fifo, const void *pData, unsigned int len);
+unsigned int fifo_GetDataLen_Box(const Fifo *fifo);
 
 #ifdef __cplusplus
 }
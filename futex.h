@@ -0,0 +1,35 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Sleep while *addr == val, deadline is absolute os_get_nsec_clock time, 0 waits forever.
+// Only wakes whose bitset shares a bit with bitset end the wait.
+static inline int futex_wait(volatile unsigned int *addr, unsigned int val, unsigned long long deadline,
+                             unsigned int bitset)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val, deadline ? &ts : NULL, NULL,
+                   bitset);
+}
+
+static inline int futex_wake(volatile unsigned int *addr, int cnt, unsigned int bitset)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG, cnt, NULL, NULL, bitset);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // _FUTEX_H_
@@ -0,0 +1,787 @@
+/*
+ * green.c
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "rtos.h"
+#include "green.h"
+#include "trace.h"
+
+#define GREEN_STACK_SIZE 0x10000
+#define GREEN_MAX_WORKERS 64
+#define GREEN_WAIT_HASH 256
+
+// x86-64 switches tasks with a few register moves, other targets use ucontext,
+// which also saves the signal mask and so costs a syscall per switch
+#if defined(__x86_64__)
+#define GREEN_ASM 1
+#endif
+
+enum GREEN_STATE
+{
+    GREEN_READY,
+    GREEN_RUNNING,
+    GREEN_WAITING,
+    GREEN_DONE
+};
+
+typedef struct green_task
+{
+    struct os_task task;
+    void *sp;  // saved stack pointer while switched out
+#ifndef GREEN_ASM
+    ucontext_t ctx;
+#endif
+    void *stack;
+    size_t stack_len;
+    struct green_task *next;  // run queue
+    struct green_task *wnext;  // wait bucket
+    struct green_task *wprev;
+    const void *wait_key;  // semaphore or futex word waited for, NULL while sleeping
+    unsigned long long deadline;  // os_get_nsec_clock, 0 waits forever
+    int heap_idx;  // timer heap position, -1 if none
+    int state;
+    volatile int claimed;  // taken by the wake or the timeout that ends the wait
+    pthread_mutex_t *unlock;  // released by the worker once the task is off its stack
+    int id;
+} GREEN_TASK;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    GREEN_TASK *head;
+    volatile int waiters;
+} GREEN_BUCKET;
+
+// a worker runs the tasks of its own queue and steals from the others when it is empty
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GREEN_TASK *head;
+    GREEN_TASK *tail;
+    volatile int cnt;
+    int idx;
+    void *sched_sp;
+#ifndef GREEN_ASM
+    ucontext_t sched_ctx;
+#endif
+} __attribute__((aligned(64))) GREEN_WORKER;
+
+static volatile int green_on;
+static volatile int green_started;
+static int green_stack_size;
+static volatile int green_worker_num;
+static GREEN_WORKER green_workers[GREEN_MAX_WORKERS];
+static volatile unsigned long long green_idle;  // bit per sleeping worker
+static volatile unsigned int green_rr;  // queue for tasks readied outside the workers
+static volatile int green_next_id;
+static GREEN_BUCKET green_wait[GREEN_WAIT_HASH];
+
+// green_timer_lock guards the deadline heap, taken after a bucket lock
+static pthread_mutex_t green_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static GREEN_TASK **green_heap;
+static int green_heap_num;
+static int green_heap_max;
+static volatile unsigned long long green_next_deadline = ~0ULL;
+
+static __thread GREEN_WORKER *green_worker_cur;
+static __thread GREEN_TASK *green_cur;
+
+#ifdef GREEN_ASM
+// Save the callee-saved registers on the current stack, store its pointer to *save_sp and resume sp
+__attribute__((visibility("hidden"))) void green_ctx_switch(void **save_sp, void *sp);
+__asm__(".text\n"
+        ".globl green_ctx_switch\n"
+        ".type green_ctx_switch, @function\n"
+        "green_ctx_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size green_ctx_switch, .-green_ctx_switch\n");
+#endif
+
+// Tasks move between workers, so thread locals are read through calls the compiler cannot cache
+static __attribute__((noinline)) GREEN_TASK *green_self(void)
+{
+    return green_cur;
+}
+
+static __attribute__((noinline)) GREEN_WORKER *green_worker_self(void)
+{
+    return green_worker_cur;
+}
+
+static GREEN_BUCKET *green_bucket(const void *key)
+{
+    return &green_wait[((uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> 56 & (GREEN_WAIT_HASH - 1)];
+}
+
+// Hand new work to a sleeping worker, costs a load while all are busy
+static void green_wake_idle(void)
+{
+    unsigned long long idle = __atomic_load_n(&green_idle, __ATOMIC_SEQ_CST);
+    int i;
+
+    while (idle)
+    {
+        i = __builtin_ctzll(idle);
+        if (__atomic_compare_exchange_n(&green_idle, &idle, idle & ~(1ULL << i), 0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST))
+        {
+            pthread_mutex_lock(&green_workers[i].lock);
+            pthread_cond_signal(&green_workers[i].cond);
+            pthread_mutex_unlock(&green_workers[i].lock);
+            return;
+        }
+    }
+}
+
+// Queue t on the caller's worker, or spread over the workers when called from outside
+static void green_push_ready(GREEN_TASK *t)
+{
+    GREEN_WORKER *w = green_worker_self();
+
+    if (w == NULL)
+        w = &green_workers[__atomic_fetch_add(&green_rr, 1, __ATOMIC_RELAXED) % green_worker_num];
+    t->state = GREEN_READY;
+    t->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+        w->tail->next = t;
+    else
+        w->head = t;
+    w->tail = t;
+    __atomic_fetch_add(&w->cnt, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->lock);
+    green_wake_idle();
+}
+
+static GREEN_TASK *green_pop(GREEN_WORKER *w)
+{
+    GREEN_TASK *t;
+
+    if (__atomic_load_n(&w->cnt, __ATOMIC_RELAXED) == 0)
+        return NULL;
+    pthread_mutex_lock(&w->lock);
+    t = w->head;
+    if (t)
+    {
+        w->head = t->next;
+        if (w->head == NULL)
+            w->tail = NULL;
+        __atomic_fetch_sub(&w->cnt, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return t;
+}
+
+static GREEN_TASK *green_take(GREEN_WORKER *w)
+{
+    GREEN_TASK *t;
+    int i, n = green_worker_num;
+
+    if ((t = green_pop(w)) != NULL)
+        return t;
+    for (i = 1; i < n; i++)
+    {
+        if ((t = green_pop(&green_workers[(w->idx + i) % n])) != NULL)
+            return t;
+    }
+    return NULL;
+}
+
+static void green_heap_set(int i, GREEN_TASK *t)
+{
+    green_heap[i] = t;
+    t->heap_idx = i;
+}
+
+static void green_heap_up(int i)
+{
+    GREEN_TASK *t = green_heap[i];
+    while (i > 0 && green_heap[(i - 1) / 2]->deadline > t->deadline)
+    {
+        green_heap_set(i, green_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    green_heap_set(i, t);
+}
+
+static void green_heap_down(int i)
+{
+    GREEN_TASK *t = green_heap[i];
+    int c;
+    while ((c = 2 * i + 1) < green_heap_num)
+    {
+        if (c + 1 < green_heap_num && green_heap[c + 1]->deadline < green_heap[c]->deadline)
+            c++;
+        if (green_heap[c]->deadline >= t->deadline)
+            break;
+        green_heap_set(i, green_heap[c]);
+        i = c;
+    }
+    green_heap_set(i, t);
+}
+
+static int green_heap_add(GREEN_TASK *t)
+{
+    if (green_heap_num == green_heap_max)
+    {
+        int max = green_heap_max ? green_heap_max * 2 : 64;
+        GREEN_TASK **p = realloc(green_heap, max * sizeof(*p));
+        if (p == NULL)
+            return -1;
+        green_heap = p;
+        green_heap_max = max;
+    }
+    green_heap_set(green_heap_num++, t);
+    green_heap_up(green_heap_num - 1);
+    return 0;
+}
+
+static void green_heap_del(GREEN_TASK *t)
+{
+    int i = t->heap_idx;
+    t->heap_idx = -1;
+    if (--green_heap_num == i)
+        return;
+    green_heap_set(i, green_heap[green_heap_num]);
+    green_heap_up(i);
+    green_heap_down(green_heap[i]->heap_idx);
+}
+
+// Publish the earliest deadline for idle workers, with green_timer_lock held.
+// Returns 1 if it moved earlier, a sleeping worker must then be woken to wait for it.
+static int green_timer_update(void)
+{
+    unsigned long long d = green_heap_num ? green_heap[0]->deadline : ~0ULL;
+    unsigned long long old = green_next_deadline;
+    __atomic_store_n(&green_next_deadline, d, __ATOMIC_SEQ_CST);
+    return d < old;
+}
+
+static void green_timer_del(GREEN_TASK *t)
+{
+    if (t->deadline == 0)
+        return;
+    pthread_mutex_lock(&green_timer_lock);
+    if (t->heap_idx >= 0)
+    {
+        green_heap_del(t);
+        green_timer_update();
+    }
+    pthread_mutex_unlock(&green_timer_lock);
+}
+
+// with the bucket lock held
+static void green_bucket_del(GREEN_BUCKET *b, GREEN_TASK *t)
+{
+    if (t->wprev)
+        t->wprev->wnext = t->wnext;
+    else
+        b->head = t->wnext;
+    if (t->wnext)
+        t->wnext->wprev = t->wprev;
+    __atomic_fetch_sub(&b->waiters, 1, __ATOMIC_RELAXED);
+    t->wait_key = NULL;
+}
+
+static void green_switch_in(GREEN_WORKER *w, GREEN_TASK *t)
+{
+#ifdef GREEN_ASM
+    green_ctx_switch(&w->sched_sp, t->sp);
+#else
+    swapcontext(&w->sched_ctx, &t->ctx);
+#endif
+}
+
+// Back to the worker, which releases t->unlock once t is off its stack
+static void green_switch_out(GREEN_TASK *t)
+{
+    GREEN_WORKER *w = green_worker_self();
+#ifdef GREEN_ASM
+    green_ctx_switch(&t->sp, w->sched_sp);
+#else
+    swapcontext(&t->ctx, &w->sched_ctx);
+#endif
+}
+
+// Park t on key and, if given, until the deadline. ready(arg) is tested once wakers can see t,
+// 1 is then returned without parking. Returns -1 if the deadline could not be armed.
+static int green_park(GREEN_TASK *t, const void *key, unsigned long long deadline, int (*ready)(const void *),
+                      const void *arg)
+{
+    GREEN_BUCKET *b = key ? green_bucket(key) : NULL;
+    int wake = 0;
+    int got = 0;
+
+    t->claimed = 0;
+    t->deadline = deadline;
+    t->wait_key = key;
+    if (b)
+    {
+        pthread_mutex_lock(&b->lock);
+        t->wprev = NULL;
+        t->wnext = b->head;
+        if (b->head)
+            b->head->wprev = t;
+        b->head = t;
+        __atomic_fetch_add(&b->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    if (deadline)
+    {
+        pthread_mutex_lock(&green_timer_lock);
+        if (green_heap_add(t))
+        {
+            pthread_mutex_unlock(&green_timer_lock);
+            if (b)
+            {
+                green_bucket_del(b, t);
+                pthread_mutex_unlock(&b->lock);
+            }
+            return -1;
+        }
+        wake = green_timer_update();
+        if (b)
+            pthread_mutex_unlock(&green_timer_lock);
+    }
+    if (wake)
+        green_wake_idle();
+    if (ready)
+    {
+        // a wake since the caller's last test saw no waiter, test again now that there is one
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        got = ready(arg);
+        if (got && __atomic_compare_exchange_n(&t->claimed, &(int){0}, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            if (b)
+                green_bucket_del(b, t);
+            if (deadline && !b)
+            {
+                green_heap_del(t);
+                green_timer_update();
+                pthread_mutex_unlock(&green_timer_lock);
+            }
+            else
+            {
+                green_timer_del(t);
+            }
+            if (b)
+                pthread_mutex_unlock(&b->lock);
+            return 1;
+        }
+        // otherwise a waker has claimed t already and queues it, so park anyway
+    }
+    t->state = GREEN_WAITING;
+    t->unlock = b ? &b->lock : &green_timer_lock;
+    green_switch_out(t);
+    return got;
+}
+
+// Wake the tasks whose deadline has passed
+static void green_expire(unsigned long long now)
+{
+    GREEN_TASK *t, *list = NULL;
+    GREEN_BUCKET *b;
+
+    if (now < __atomic_load_n(&green_next_deadline, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&green_timer_lock);
+    while (green_heap_num && green_heap[0]->deadline <= now)
+    {
+        t = green_heap[0];
+        green_heap_del(t);
+        if (__atomic_compare_exchange_n(&t->claimed, &(int){0}, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            t->next = list;
+            list = t;
+        }
+    }
+    green_timer_update();
+    pthread_mutex_unlock(&green_timer_lock);
+    while ((t = list) != NULL)
+    {
+        list = t->next;
+        if (t->wait_key)
+        {
+            // waits until the task has switched out and released the bucket
+            b = green_bucket(t->wait_key);
+            pthread_mutex_lock(&b->lock);
+            green_bucket_del(b, t);
+            pthread_mutex_unlock(&b->lock);
+        }
+        green_push_ready(t);
+    }
+}
+
+static void green_wake_key(const void *key, int all)
+{
+    GREEN_BUCKET *b;
+    GREEN_TASK *t, *next, *list = NULL;
+
+    if (!green_on)
+        return;
+    b = green_bucket(key);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->waiters, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&b->lock);
+    for (t = b->head; t; t = next)
+    {
+        next = t->wnext;
+        // a task claimed by its deadline is left to green_expire
+        if (t->wait_key != key ||
+            !__atomic_compare_exchange_n(&t->claimed, &(int){0}, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            continue;
+        green_bucket_del(b, t);
+        t->next = list;
+        list = t;
+        if (!all)
+            break;
+    }
+    pthread_mutex_unlock(&b->lock);
+    while ((t = list) != NULL)
+    {
+        list = t->next;
+        green_timer_del(t);
+        green_push_ready(t);
+    }
+}
+
+static void green_run(GREEN_WORKER *w, GREEN_TASK *t)
+{
+    pthread_mutex_t *m;
+
+    t->state = GREEN_RUNNING;
+    green_cur = t;
+    os_set_cur_task(&t->task);
+    green_switch_in(w, t);
+    green_cur = NULL;
+    os_set_cur_task(NULL);
+    // t is off its stack, once m is released a waker may queue it again
+    m = t->unlock;
+    t->unlock = NULL;
+    if (t->state == GREEN_DONE)
+    {
+        munmap(t->stack, t->stack_len);
+        free(t);
+    }
+    else if (t->state == GREEN_RUNNING)
+    {
+        green_push_ready(t);
+    }
+    if (m)
+        pthread_mutex_unlock(m);
+}
+
+// Sleep until a task is queued somewhere or the earliest deadline
+static void green_idle_wait(GREEN_WORKER *w)
+{
+    struct timespec ts;
+    unsigned long long d;
+    int i, n = green_worker_num;
+
+    pthread_mutex_lock(&w->lock);
+    __atomic_fetch_or(&green_idle, 1ULL << w->idx, __ATOMIC_SEQ_CST);
+    // pairs with green_push_ready, a queued task is either seen here or wakes us
+    for (i = 0; green_started && i < n && __atomic_load_n(&green_workers[i].cnt, __ATOMIC_SEQ_CST) == 0; i++)
+        ;
+    d = __atomic_load_n(&green_next_deadline, __ATOMIC_SEQ_CST);
+    if (!green_started || d == ~0ULL)
+    {
+        if (!green_started || i == n)
+            pthread_cond_wait(&w->cond, &w->lock);
+    }
+    else if (i == n && d > os_get_nsec_clock())
+    {
+        ts.tv_sec = d / 1000000000ULL;
+        ts.tv_nsec = d % 1000000000ULL;
+        pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+    }
+    __atomic_fetch_and(&green_idle, ~(1ULL << w->idx), __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void *green_worker(void *p)
+{
+    GREEN_WORKER *w = p;
+    GREEN_TASK *t;
+
+    green_worker_cur = w;
+    for (;;)
+    {
+        t = NULL;
+        if (green_started)
+        {
+            green_expire(os_get_nsec_clock());
+            t = green_take(w);
+        }
+        if (t)
+            green_run(w, t);
+        else
+            green_idle_wait(w);
+    }
+    return 0;
+}
+
+static void green_entry(void)
+{
+    GREEN_TASK *t = green_self();
+
+    OS_TRACE(TRACE_TASK_START, -1, t->task.entry_func, t->task.priority);
+    t->task.entry_func(t->task.data);
+    OS_TRACE(TRACE_TASK_STOP, -1, t->task.entry_func, 0);
+    t->state = GREEN_DONE;
+    green_switch_out(t);
+}
+
+int green_enabled(void)
+{
+    return green_on;
+}
+
+int green_active(void)
+{
+    return green_on && green_self() != NULL;
+}
+
+int green_task_id(void)
+{
+    GREEN_TASK *t = green_on ? green_self() : NULL;
+    return t ? t->id : 0;
+}
+
+int green_create(const char *name, void (*entry_func)(void *), int priority, void *data, int stack_size)
+{
+    GREEN_TASK *t;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = stack_size > 0 ? (size_t)stack_size : (size_t)green_stack_size;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL)
+        return -1;
+    // pages are only committed when touched, the lowest one guards against overflow
+    t->stack_len = ((len + page - 1) & ~(page - 1)) + page;
+    t->stack = mmap(NULL, t->stack_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                    -1, 0);
+    if (t->stack == MAP_FAILED)
+    {
+        free(t);
+        return -1;
+    }
+    mprotect(t->stack, page, PROT_NONE);
+#ifdef GREEN_ASM
+    {
+        // the frame green_ctx_switch pops, returning into green_entry
+        uintptr_t *sp = (uintptr_t *)(((uintptr_t)t->stack + t->stack_len) & ~(uintptr_t)15);
+        *--sp = 0;  // green_entry never returns
+        *--sp = (uintptr_t)green_entry;
+        sp -= 6;
+        memset(sp, 0, 6 * sizeof(*sp));
+        *--sp = 0x037FULL << 32 | 0x1F80;  // default x87 control word and MXCSR
+        t->sp = sp;
+    }
+#else
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stack;
+    t->ctx.uc_stack.ss_size = t->stack_len;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, green_entry, 0);
+#endif
+
+    strncpy(t->task.name, name, sizeof(t->task.name) - 1);
+    t->task.entry_func = entry_func;
+    t->task.priority = priority;
+    t->task.data = data;
+    t->heap_idx = -1;
+    t->id = __atomic_add_fetch(&green_next_id, 1, __ATOMIC_RELAXED);
+
+    green_push_ready(t);
+    return 0;
+}
+
+void green_start(void)
+{
+    int i;
+
+    __atomic_store_n(&green_started, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < green_worker_num; i++)
+    {
+        pthread_mutex_lock(&green_workers[i].lock);
+        pthread_cond_signal(&green_workers[i].cond);
+        pthread_mutex_unlock(&green_workers[i].lock);
+    }
+}
+
+static int green_sem_ready(const void *sem)
+{
+    return SemaphoreTryLock((SEM_ID *)sem);
+}
+
+int green_sem_lock(SEM_ID *sem, int timeout_ms)
+{
+    GREEN_TASK *t = green_self();
+    unsigned long long deadline = timeout_ms > 0 ? os_get_nsec_clock() + timeout_ms * 1000000ULL : 0;
+    int ok = timeout_ms > 0 ? 1 : 0;
+    int ret;
+
+    for (;;)
+    {
+        if (SemaphoreTryLock(sem))
+            return ok;
+        if (deadline && os_get_nsec_clock() >= deadline)
+            return 0;
+        ret = green_park(t, sem, deadline, green_sem_ready, sem);
+        if (ret > 0)
+            return ok;
+        if (ret < 0)
+            green_yield();  // no room for the timer, poll instead
+    }
+}
+
+void green_sem_wake(SEM_ID *sem)
+{
+    green_wake_key(sem, 0);
+}
+
+typedef struct
+{
+    volatile unsigned int *addr;
+    unsigned int val;
+} GREEN_FUTEX;
+
+static int green_futex_ready(const void *p)
+{
+    const GREEN_FUTEX *f = p;
+    return __atomic_load_n(f->addr, __ATOMIC_RELAXED) != f->val;
+}
+
+// Park while *addr == val until green_futex_wake(addr) or the deadline, the caller checks its condition again
+void green_futex_wait(volatile unsigned int *addr, unsigned int val, unsigned long long deadline)
+{
+    GREEN_FUTEX f = {addr, val};
+
+    if (green_park(green_self(), (const void *)addr, deadline, green_futex_ready, &f) < 0)
+        green_yield();
+}
+
+// Wake every green task parked on addr, the caller changed *addr first
+void green_futex_wake(const void *addr)
+{
+    green_wake_key(addr, 1);
+}
+
+void green_sleep_ms(int ms)
+{
+    if (ms <= 0)
+    {
+        green_yield();
+        return;
+    }
+    green_sleep_until(os_get_nsec_clock() + ms * 1000000ULL);
+}
+
+// Sleep until the os_get_nsec_clock time deadline, a deadline already passed only yields
+void green_sleep_until(unsigned long long deadline)
+{
+    struct timespec ts;
+
+    if (deadline <= os_get_nsec_clock())
+    {
+        green_yield();
+        return;
+    }
+    if (green_park(green_self(), NULL, deadline, NULL, NULL) < 0)
+    {
+        // no room for the timer, block the worker instead
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+}
+
+void green_yield(void)
+{
+    GREEN_TASK *t = green_self();
+    t->unlock = NULL;
+    green_switch_out(t);
+}
+
+// Following os_create_task calls make green tasks run by worker threads,
+// stack_size <= 0 selects the default
+int os_green_init(int workers, int stack_size)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    int i;
+
+    if (green_on)
+        return 0;
+    if (workers <= 0)
+        workers = 1;
+    if (workers > GREEN_MAX_WORKERS)
+        workers = GREEN_MAX_WORKERS;
+    green_stack_size = stack_size > 0 ? stack_size : GREEN_STACK_SIZE;
+    for (i = 0; i < GREEN_WAIT_HASH; i++)
+        pthread_mutex_init(&green_wait[i].lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&green_workers[i].lock, NULL);
+        pthread_cond_init(&green_workers[i].cond, &attr);
+        green_workers[i].idx = i;
+    }
+    pthread_condattr_destroy(&attr);
+    green_worker_num = workers;
+    for (i = 0; i < workers; i++)
+    {
+        if (pthread_create(&thread, NULL, green_worker, &green_workers[i]))
+        {
+            if (i == 0)
+                return -1;
+            green_worker_num = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    green_on = 1;
+    return 0;
+}
+
+void os_task_yield(void)
+{
+    if (green_active())
+        green_yield();
+    else
+        sched_yield();
+}
@@ -0,0 +1,30 @@
+#ifndef _GREEN_H_
+#define _GREEN_H_
+
+#include "rtos.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// M:N task backend, used by task.c and the blocking calls of rtos.c
+int green_enabled(void);
+int green_active(void);  // the caller runs as a green task
+int green_task_id(void);  // of the calling green task, 0 outside them
+int green_create(const char *name, void (*entry_func)(void *), int priority, void *data, int stack_size);
+void green_start(void);
+int green_sem_lock(SEM_ID *sem, int timeout_ms);
+void green_sem_wake(SEM_ID *sem);
+void green_futex_wait(volatile unsigned int *addr, unsigned int val, unsigned long long deadline);
+void green_futex_wake(const void *addr);
+void green_sleep_ms(int ms);
+void green_sleep_until(unsigned long long deadline);  // absolute, os_get_nsec_clock
+void green_yield(void);
+
+void os_set_cur_task(struct os_task *task);
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // _GREEN_H_
@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "hist.h"
+
+static unsigned int hist_index(unsigned long long v)
+{
+    int msb;
+    if (v < HIST_SUB)
+        return (unsigned int)v;
+    if (v >> HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    msb = 63 - __builtin_clzll(v);
+    return (unsigned int)(msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           (unsigned int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// lowest value counted in bucket idx
+static unsigned long long hist_value(unsigned int idx)
+{
+    unsigned int e = idx / HIST_SUB;
+    unsigned int m = idx % HIST_SUB;
+    if (e == 0)
+        return m;
+    return (unsigned long long)(HIST_SUB + m) << (e - 1);
+}
+
+void hist_Init(Hist *h)
+{
+    memset((void *)h, 0, sizeof(*h));
+}
+
+// Lock-free, any number of threads may record at once
+void hist_Record(Hist *h, unsigned long long v)
+{
+    unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->bucket[hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->cnt, 1, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+unsigned long long hist_Percentile(const Hist *h, double q)
+{
+    unsigned long long total = 0, rank, seen = 0, max;
+    unsigned int i;
+
+    // the buckets are summed here, cnt may be ahead of them
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+    if (total == 0)
+        return 0;
+    if (q < 0)
+        q = 0;
+    rank = (unsigned long long)(q * (double)total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+    for (i = 0; i < HIST_BUCKETS - 1; i++)
+    {
+        seen += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+        if (seen >= rank)
+            break;
+    }
+    max = hist_GetMax(h);
+    if (i == HIST_BUCKETS - 1 || hist_value(i + 1) - 1 > max)
+        return max;
+    return hist_value(i + 1) - 1;
+}
+
+unsigned long long hist_GetCount(const Hist *h)
+{
+    return __atomic_load_n(&h->cnt, __ATOMIC_RELAXED);
+}
+
+unsigned long long hist_GetMax(const Hist *h)
+{
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+unsigned long long hist_GetMean(const Hist *h)
+{
+    unsigned long long cnt = hist_GetCount(h);
+    return cnt ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / cnt : 0;
+}
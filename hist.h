@@ -0,0 +1,36 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Log-linear histogram: every power of two is split into HIST_SUB linear buckets,
+// so a recorded value is known within 1 / HIST_SUB of itself.
+// Values from 2^HIST_MAX_BITS up are counted in the last bucket.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct
+{
+    volatile unsigned long long cnt;
+    volatile unsigned long long sum;
+    volatile unsigned long long max;
+    volatile unsigned long long bucket[HIST_BUCKETS];
+} Hist;
+
+void hist_Init(Hist *h);
+void hist_Record(Hist *h, unsigned long long v);
+// q in [0, 1], returns the upper bound of the bucket holding that quantile, 0 if empty
+unsigned long long hist_Percentile(const Hist *h, double q);
+unsigned long long hist_GetCount(const Hist *h);
+unsigned long long hist_GetMax(const Hist *h);
+unsigned long long hist_GetMean(const Hist *h);
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // _HIST_H_
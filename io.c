@@ -5,29 +5,77 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "rtos.h"
 #include "fifo.h"
+#include "spsc.h"
+#include "mpmc.h"
+#include "hist.h"
+#include "trace.h"
 
 #define IO_MAX_NUM 100
+#define IO_EVSET_NUM 16
 
 #define IO_DEB 1
 
+#define IO_STAT_SHARDS 8
+#define IO_STAT_LINE 64
+// the high-water mark is sampled every IO_HWM_SAMPLE messages of a shard and on every drop
+#define IO_HWM_SAMPLE 16
+
+// Threads count into their own shard, so the counters never share a line between them
+typedef struct
+{
+    unsigned long long msgs_in;
+    unsigned long long bytes_in;
+    unsigned long long msgs_out;
+    unsigned long long bytes_out;
+    unsigned long long drops;
+    unsigned long long high_water;
+    unsigned long long rd_block_us;
+    unsigned long long wr_block_us;
+} __attribute__((aligned(IO_STAT_LINE))) IO_STAT_SHARD;
+
 typedef struct
 {
     int size;
     int cnt;
-    short mode;
+    unsigned int mode;
     short id;
 
     void (*handler)(short);
 
     Fifo *fifo;
+    SpscFifo *spsc;
+    MpmcQueue *mpmc;
+    Hist *lat;  // O_TIMESTAMP write to read delay
     SEM_ID sem_op;
     SEM_ID sem;
+    SEM_ID sem_wr;  // O_WRITE_BLOCK writers wait for space here
+    volatile int wr_waiters;  // writers about to wait on sem_wr, readers only post while nonzero
     SEM_ID *sem_select;
+
+    // event set membership
+    short ev_set;  // set number + 1, 0 if none
+    short ev_next;
+    unsigned short ev_mask;
+    volatile unsigned short ev_pending;
+    volatile unsigned char ev_queued;
+
+    IO_STAT_SHARD stats[IO_STAT_SHARDS];
 } IO_STREAM_REC;
 
+typedef struct
+{
+    int used;
+    MUTEX_ID mutex;
+    SEM_ID sem;
+    // list of streams with pending events
+    short head;
+    short tail;
+} IO_EVSET_REC;
+
 typedef struct
 {
     IO_STREAM_REC stream;
@@ -39,13 +87,27 @@ typedef struct
     int mem_size;
     IO_REC io_descr[IO_MAX_NUM];
     char *io_buf;
+    IO_EVSET_REC evset[IO_EVSET_NUM];
+    MUTEX_ID evset_mutex;
 } IO_DATA;
 
 static IO_DATA io_data;
+static __thread int io_stat_shard = -1;
+static unsigned int io_stat_next;
 
 #define GET_IO_DATA_PTR() ((IO_DATA *)&io_data)
 #define GET_IO_REC_PTR(X) (&iptr->io_descr[X].stream)
 #define IS_OPENED(X) ((X)->cnt)
+#define IS_SPSC(X) ((X)->mode & O_SPSC)
+#define IS_MPMC(X) ((X)->mode & O_MPMC)
+#define IS_FRAMED(X) ((X)->mode & O_FRAMED)
+#define IS_BOX(X) ((X)->mode & O_BOX)
+#define IS_STAMPED(X) ((X)->mode & O_TIMESTAMP)
+
+#define IO_FRAME_HDR_MAX 5
+#define IO_TS_LEN sizeof(unsigned long long)
+
+#define IO_STAT_ADD(sh, f, v) __atomic_fetch_add(&(sh)->f, (v), __ATOMIC_RELAXED)
 
 static void *io_allocate_mem(int size)
 {
@@ -63,6 +125,562 @@ static void *io_allocate_mem(int size)
     return ret;
 }
 
+static void *io_allocate_aligned(int size, int align)
+{
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    int pad = (int)(-(uintptr_t)iptr->mem_ptr & (uintptr_t)(align - 1));
+    if (io_allocate_mem(pad) == NULL)
+    {
+        return 0;
+    }
+    return io_allocate_mem(size);
+}
+
+// Allocate the ring of a stream, returns its size in bytes or 0
+static unsigned long long io_alloc_ring(IO_STREAM_REC *pr, int cnt, int size, unsigned int *mode)
+{
+    unsigned long long limit = (unsigned long long)size * (unsigned int)cnt;
+    void *p_buf = NULL;
+    if (*mode & O_BOX)
+    {
+        // latest value channel, a spare slot lets writers pass a stalled one
+        *mode &= ~(O_MIRROR | O_SPSC | O_MPMC | O_OVERWRITE | O_POW2 | O_NOCOPY);
+        if (cnt < 2)
+            cnt = 2;
+        limit = fifo_BoxBufSize(cnt, size);
+        if (limit > 0x7fffffff || (pr->fifo = io_allocate_aligned(sizeof(Fifo), 8)) == NULL ||
+            (p_buf = io_allocate_aligned((int)limit, 8)) == NULL)
+            return 0;
+        fifo_InitBox(pr->fifo, p_buf, cnt, size);
+        return (unsigned long long)size * (unsigned int)cnt;
+    }
+    if (*mode & O_OVERWRITE)
+    {
+        // lossy element queue
+        *mode |= O_MPMC;
+    }
+    if (*mode & O_MPMC)
+    {
+        *mode &= ~(O_MIRROR | O_SPSC);
+        if (*mode & O_POW2)
+            cnt = (int)fifo_RoundPow2(cnt);
+        limit = (unsigned long long)size * (unsigned int)cnt;
+        // checked in 64 bits, mpmc_BufSize wraps and io_allocate_aligned takes an int
+        if (cnt <= 0 || (unsigned long long)mpmc_BufSize(1, size) * (unsigned int)cnt > 0x7fffffff)
+            return 0;
+        if ((pr->mpmc = io_allocate_aligned(sizeof(MpmcQueue), MPMC_CACHE_LINE)) == NULL ||
+            (p_buf = io_allocate_aligned((int)mpmc_BufSize(cnt, size), 8)) == NULL)
+            return 0;
+        if (*mode & O_OVERWRITE)
+            mpmc_InitLossy(pr->mpmc, p_buf, cnt, size);
+        else
+            mpmc_InitQueue(pr->mpmc, p_buf, cnt, size);
+        return limit;
+    }
+    if (*mode & O_POW2)
+        limit = fifo_RoundPow2(limit);
+    if (*mode & O_MIRROR)
+    {
+        p_buf = fifo_MapMirror(&limit);
+        if (p_buf == NULL)
+            *mode &= ~O_MIRROR;  // fall back to the io_init buffer
+    }
+    if (p_buf == NULL && (limit > 0x7fffffff || (p_buf = io_allocate_mem((int)limit)) == NULL))
+    {
+        return 0;
+    }
+    if (*mode & O_SPSC)
+    {
+        if (limit > 0x7fffffff || (pr->spsc = io_allocate_aligned(sizeof(SpscFifo), SPSC_CACHE_LINE)) == NULL)
+            return 0;
+        spsc_InitFifo(pr->spsc, p_buf, (unsigned int)limit);
+        pr->spsc->mirror = (*mode & O_MIRROR) != 0;
+    }
+    else
+    {
+        if ((pr->fifo = io_allocate_aligned(sizeof(Fifo), 8)) == NULL)
+            return 0;
+        fifo_InitFifo(pr->fifo, p_buf, limit);
+        pr->fifo->mirror = (*mode & O_MIRROR) != 0;
+    }
+    return limit;
+}
+
+static unsigned int io_data_len(IO_STREAM_REC *pr)
+{
+    unsigned long long len;
+    if (IS_BOX(pr))
+        return fifo_GetDataLen_Box(pr->fifo);
+    if (IS_MPMC(pr))
+        return mpmc_GetDataLen(pr->mpmc);
+    len = IS_SPSC(pr) ? spsc_GetDataLen(pr->spsc) : fifo_GetDataLen(pr->fifo);
+    if (IS_STAMPED(pr) && !IS_FRAMED(pr))
+        len = len / (pr->size + IO_TS_LEN) * pr->size;
+    return len > 0x7fffffff ? 0x7fffffff : (unsigned int)len;
+}
+
+static IO_STAT_SHARD *io_stat(IO_STREAM_REC *pr)
+{
+    if (io_stat_shard < 0)
+        io_stat_shard = (int)(__atomic_fetch_add(&io_stat_next, 1, __ATOMIC_RELAXED) % IO_STAT_SHARDS);
+    return &pr->stats[io_stat_shard];
+}
+
+static void io_stat_hwm(IO_STREAM_REC *pr, IO_STAT_SHARD *sh)
+{
+    unsigned int level = io_data_len(pr);
+    if (level > __atomic_load_n(&sh->high_water, __ATOMIC_RELAXED))
+        __atomic_store_n(&sh->high_water, level, __ATOMIC_RELAXED);
+}
+
+// a write of len bytes as msgs messages, len 0 counts a dropped write
+static void io_stat_in(IO_STREAM_REC *pr, unsigned int len, unsigned int msgs)
+{
+    IO_STAT_SHARD *sh = io_stat(pr);
+    unsigned long long n;
+    if (len == 0)
+    {
+        IO_STAT_ADD(sh, drops, 1);
+        io_stat_hwm(pr, sh);
+        return;
+    }
+    IO_STAT_ADD(sh, bytes_in, len);
+    n = IO_STAT_ADD(sh, msgs_in, msgs);
+    if (n / IO_HWM_SAMPLE != (n + msgs) / IO_HWM_SAMPLE)
+        io_stat_hwm(pr, sh);
+}
+
+static void io_stat_out(IO_STREAM_REC *pr, unsigned int len, unsigned int msgs)
+{
+    IO_STAT_SHARD *sh = io_stat(pr);
+    IO_STAT_ADD(sh, bytes_out, len);
+    IO_STAT_ADD(sh, msgs_out, msgs);
+}
+
+// number of the blocks in len that make up bytes
+static unsigned int io_stat_blocks(const unsigned int *len, unsigned int bytes)
+{
+    unsigned int i, n;
+    for (i = 0, n = 0; n < bytes; i++)
+        n += len[i];
+    return i;
+}
+
+static void io_get_stats(IO_STREAM_REC *pr, IO_STATS *st)
+{
+    int i;
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < IO_STAT_SHARDS; i++)
+    {
+        IO_STAT_SHARD *sh = &pr->stats[i];
+        st->msgs_in += __atomic_load_n(&sh->msgs_in, __ATOMIC_RELAXED);
+        st->bytes_in += __atomic_load_n(&sh->bytes_in, __ATOMIC_RELAXED);
+        st->msgs_out += __atomic_load_n(&sh->msgs_out, __ATOMIC_RELAXED);
+        st->bytes_out += __atomic_load_n(&sh->bytes_out, __ATOMIC_RELAXED);
+        st->drops += __atomic_load_n(&sh->drops, __ATOMIC_RELAXED);
+        st->rd_block_us += __atomic_load_n(&sh->rd_block_us, __ATOMIC_RELAXED);
+        st->wr_block_us += __atomic_load_n(&sh->wr_block_us, __ATOMIC_RELAXED);
+        if (sh->high_water > st->high_water)
+            st->high_water = sh->high_water;
+    }
+    if (IS_MPMC(pr))
+        st->drops += mpmc_GetDropped(pr->mpmc);
+    if (pr->fifo && !IS_BOX(pr))
+        st->rd_contention = __atomic_load_n(&pr->fifo->rd_contention, __ATOMIC_RELAXED);
+}
+
+// counts racing with the reset may survive it
+static void io_reset_stats(IO_STREAM_REC *pr)
+{
+    memset(pr->stats, 0, sizeof(pr->stats));
+    if (IS_MPMC(pr))
+        __atomic_store_n(&pr->mpmc->dropped, 0, __ATOMIC_RELAXED);
+    if (pr->fifo && !IS_BOX(pr))
+        __atomic_store_n(&pr->fifo->rd_contention, 0, __ATOMIC_RELAXED);
+    if (pr->lat)
+        hist_Init(pr->lat);
+}
+
+// Framed streams store every record after its length as a base-128 varint
+static unsigned int io_ins_record(IO_STREAM_REC *pr, const void *buf, unsigned int len)
+{
+    unsigned char hdr[IO_FRAME_HDR_MAX];
+    unsigned int hlen = 0;
+    unsigned int v = len;
+    const void *pdata[3];
+    unsigned int plen[3];
+    unsigned int ret, n = 0;
+    unsigned long long ts;
+
+    do
+    {
+        hdr[hlen++] = (unsigned char)((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+        v >>= 7;
+    }
+    while (v);
+    pdata[n] = hdr;
+    plen[n++] = hlen;
+    if (IS_STAMPED(pr))
+    {
+        // the time follows the header, the length does not count it
+        ts = os_get_nsec_clock();
+        pdata[n] = &ts;
+        plen[n++] = IO_TS_LEN;
+    }
+    pdata[n] = buf;
+    plen[n++] = len;
+    ret = IS_SPSC(pr) ? spsc_InsBlocks(pr->spsc, pdata, plen, n) : fifo_InsBlocks(pr->fifo, pdata, plen, n);
+    return ret ? len : 0;
+}
+
+static unsigned int io_peek(IO_STREAM_REC *pr, unsigned int len, IO_SPAN *span)
+{
+    return IS_SPSC(pr) ? spsc_ReadPeek(pr->spsc, len, span) : fifo_ReadPeek(pr->fifo, len, span);
+}
+
+static void io_release(IO_STREAM_REC *pr, const IO_SPAN *span, unsigned int len)
+{
+    if (IS_SPSC(pr))
+        spsc_ReadRelease(pr->spsc, span, len);
+    else
+        fifo_ReadRelease(pr->fifo, span, len);
+}
+
+// Claims the data of a framed stream, returns 1 and the length of the next record
+static int io_peek_record(IO_STREAM_REC *pr, IO_SPAN *span, unsigned int *hlen, unsigned int *rlen)
+{
+    unsigned char hdr[IO_FRAME_HDR_MAX];
+    unsigned int avail, i;
+
+    avail = io_peek(pr, 0xffffffff, span);
+    if (avail == 0)
+        return 0;
+    fifo_SpanRead(span, 0, hdr, avail < IO_FRAME_HDR_MAX ? avail : IO_FRAME_HDR_MAX);
+    *rlen = 0;
+    for (i = 0; i < IO_FRAME_HDR_MAX && i < avail; i++)
+    {
+        *rlen |= (unsigned int)(hdr[i] & 0x7f) << (7 * i);
+        if (!(hdr[i] & 0x80))
+            break;
+    }
+    // records are committed whole
+    *hlen = i + 1;
+    return 1;
+}
+
+static int io_extr_record(IO_STREAM_REC *pr, void *buf, unsigned int len)
+{
+    IO_SPAN span;
+    unsigned int hlen, rlen;
+    unsigned long long ts;
+
+    if (!io_peek_record(pr, &span, &hlen, &rlen))
+        return 0;
+    if (rlen > len)
+    {
+        io_release(pr, &span, 0);
+        return IO_MSGSIZE;
+    }
+    if (IS_STAMPED(pr))
+    {
+        fifo_SpanRead(&span, hlen, &ts, IO_TS_LEN);
+        hist_Record(pr->lat, os_get_nsec_clock() - ts);
+        hlen += IO_TS_LEN;
+    }
+    if (buf)
+        fifo_SpanRead(&span, hlen, buf, rlen);
+    io_release(pr, &span, hlen + rlen);
+    return (int)rlen;
+}
+
+// O_TIMESTAMP element streams keep the write time in front of every element
+static unsigned int io_ins_stamped(IO_STREAM_REC *pr, const void *buf, unsigned int len)
+{
+    IO_SPAN span;
+    unsigned int esz = pr->size + IO_TS_LEN;
+    unsigned int n = len / pr->size;
+    unsigned int i;
+    unsigned long long ts;
+
+    if (n == 0 || n > 0xffffffff / esz)
+        return 0;
+    if ((IS_SPSC(pr) ? spsc_WriteReserve(pr->spsc, n * esz, &span) : fifo_WriteReserve(pr->fifo, n * esz, &span)) == 0)
+        return 0;
+    ts = os_get_nsec_clock();
+    for (i = 0; i < n; i++)
+    {
+        fifo_SpanWrite(&span, i * esz, &ts, IO_TS_LEN);
+        if (buf)
+            fifo_SpanWrite(&span, i * esz + IO_TS_LEN, (const char *)buf + i * pr->size, pr->size);
+    }
+    if (IS_SPSC(pr))
+        spsc_WriteCommit(pr->spsc, &span);
+    else
+        fifo_WriteCommit(pr->fifo, &span);
+    return n * pr->size;
+}
+
+static int io_extr_stamped(IO_STREAM_REC *pr, void *buf, unsigned int len)
+{
+    IO_SPAN span;
+    unsigned int esz = pr->size + IO_TS_LEN;
+    unsigned int n = len / pr->size;
+    unsigned int i, got;
+    unsigned long long ts, now;
+
+    if (n == 0 || n > 0xffffffff / esz || (got = io_peek(pr, n * esz, &span)) == 0)
+        return 0;
+    n = got / esz;
+    now = os_get_nsec_clock();
+    for (i = 0; i < n; i++)
+    {
+        fifo_SpanRead(&span, i * esz, &ts, IO_TS_LEN);
+        hist_Record(pr->lat, now - ts);
+        if (buf)
+            fifo_SpanRead(&span, i * esz + IO_TS_LEN, (char *)buf + i * pr->size, pr->size);
+    }
+    io_release(pr, &span, n * esz);
+    return (int)(n * pr->size);
+}
+
+static unsigned int io_ins(IO_STREAM_REC *pr, const void *buf, unsigned int len)
+{
+    if (IS_FRAMED(pr))
+        return io_ins_record(pr, buf, len);
+    if (IS_STAMPED(pr))
+        return io_ins_stamped(pr, buf, len);
+    if (IS_BOX(pr))
+        return fifo_InsBlock_Box(pr->fifo, buf, len);
+    if (IS_MPMC(pr))
+        return mpmc_InsBlock(pr->mpmc, buf, len);
+    return IS_SPSC(pr) ? spsc_InsBlock(pr->spsc, buf, len) : fifo_InsBlock(pr->fifo, buf, len);
+}
+
+static int io_extr(IO_STREAM_REC *pr, void *buf, unsigned int len)
+{
+    if (IS_FRAMED(pr))
+        return io_extr_record(pr, buf, len);
+    if (IS_STAMPED(pr))
+        return io_extr_stamped(pr, buf, len);
+    if (IS_BOX(pr))
+        return fifo_ExtrBlock_Box(pr->fifo, buf, len);
+    if (IS_MPMC(pr))
+        return mpmc_ExtrBlock(pr->mpmc, buf, len);
+    return IS_SPSC(pr) ? spsc_ExtrBlock(pr->spsc, buf, len) : fifo_ExtrBlock(pr->fifo, buf, len);
+}
+
+static unsigned int io_free_len(IO_STREAM_REC *pr)
+{
+    unsigned long long len;
+    if (IS_BOX(pr))
+        len = (unsigned long long)pr->cnt * pr->size;  // writers never wait for readers
+    else if (IS_MPMC(pr))
+        len = (unsigned long long)pr->cnt * pr->size - mpmc_GetDataLen(pr->mpmc);
+    else
+        len = IS_SPSC(pr) ? spsc_GetFreeLen(pr->spsc) : fifo_GetFreeLen(pr->fifo);
+    if (IS_STAMPED(pr) && !IS_FRAMED(pr))
+        len = len / (pr->size + IO_TS_LEN) * pr->size;
+    return len > 0x7fffffff ? 0x7fffffff : (unsigned int)len;
+}
+
+// a read would return data, a framed record of any length counts
+static int io_readable(IO_STREAM_REC *pr)
+{
+    return io_data_len(pr) >= (IS_FRAMED(pr) ? 1 : (unsigned int)pr->size);
+}
+
+// current readiness of a stream as IO_EV_READ/IO_EV_WRITE bits
+static unsigned short io_ev_state(IO_STREAM_REC *pr)
+{
+    unsigned short ev = 0;
+    if (io_readable(pr))
+        ev |= IO_EV_READ;
+    if (io_free_len(pr) >= (unsigned int)pr->size)
+        ev |= IO_EV_WRITE;
+    return ev;
+}
+
+// must be called with the set mutex held
+static void io_ev_enqueue(IO_EVSET_REC *es, IO_STREAM_REC *pr)
+{
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (pr->ev_queued)
+        return;
+    pr->ev_queued = 1;
+    pr->ev_next = -1;
+    if (es->tail < 0)
+        es->head = pr->id;
+    else
+        GET_IO_REC_PTR(es->tail)->ev_next = pr->id;
+    es->tail = pr->id;
+}
+
+static void io_ev_signal(IO_STREAM_REC *pr, unsigned short ev)
+{
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    IO_EVSET_REC *es;
+    int set = pr->ev_set;
+
+    ev &= pr->ev_mask;
+    if (set == 0 || ev == 0)
+        return;
+    // already reported and not consumed yet
+    if ((pr->ev_pending & ev) == ev && pr->ev_queued)
+        return;
+    es = &iptr->evset[set - 1];
+    MutexLock(&es->mutex);
+    pr->ev_pending |= ev;
+    io_ev_enqueue(es, pr);
+    MutexUnlock(&es->mutex);
+    SemaphoreUnlock(&es->sem);
+}
+
+static void io_notify(IO_STREAM_REC *pr)
+{
+    if (!(pr->mode & O_NONBLOCK) || pr->sem_select != NULL)
+    {
+        SEM_ID *sem;
+        sem = pr->sem_select != NULL ? pr->sem_select : &pr->sem;
+        SemaphoreUnlock(sem);
+    }
+
+    io_ev_signal(pr, IO_EV_READ);
+    if (pr->handler)
+        pr->handler(pr->id);
+}
+
+static unsigned int io_insv(IO_STREAM_REC *pr, const void **buf, const unsigned int *len, int cnt)
+{
+    int i;
+    unsigned int ret = 0;
+    if (IS_MPMC(pr))
+    {
+        // one slot per element
+        for (i = 0; i < cnt && len[i] == (unsigned int)pr->size && mpmc_Push(pr->mpmc, buf[i]); i++)
+            ret += len[i];
+        return ret;
+    }
+    return IS_SPSC(pr) ? spsc_InsBlocks(pr->spsc, buf, len, cnt) : fifo_InsBlocks(pr->fifo, buf, len, cnt);
+}
+
+static unsigned int io_extrv(IO_STREAM_REC *pr, void **buf, const unsigned int *len, int cnt)
+{
+    int i;
+    unsigned int ret = 0;
+    if (IS_MPMC(pr))
+    {
+        for (i = 0; i < cnt && len[i] == (unsigned int)pr->size && mpmc_Pop(pr->mpmc, buf[i]); i++)
+            ret += len[i];
+        return ret;
+    }
+    return IS_SPSC(pr) ? spsc_ExtrBlocks(pr->spsc, buf, len, cnt) : fifo_ExtrBlocks(pr->fifo, buf, len, cnt);
+}
+
+static void io_notify_space(IO_STREAM_REC *pr)
+{
+    if (pr->mode & O_WRITE_BLOCK)
+    {
+        // pairs with the count in io_wr_wait, a writer either sees the space or gets the post
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pr->wr_waiters, __ATOMIC_RELAXED))
+            SemaphoreUnlock(&pr->sem_wr);
+    }
+    io_ev_signal(pr, IO_EV_WRITE);
+}
+
+// Wait on s until the deadline, timeout_ms <= 0 waits forever.
+// The time spent is added to *blocked_us if given.
+// Returns 0 if the deadline has passed.
+static int io_wait(SEM_ID *s, int timeout_ms, unsigned int deadline, unsigned long long *blocked_us)
+{
+    int left = 0;
+    unsigned int t0;
+    if (timeout_ms > 0)
+    {
+        left = (int)(deadline - os_get_msec_clock());
+        if (left <= 0)
+            return 0;
+    }
+    t0 = os_get_usec_clock();
+    SemaphoreLock(s, left);
+    if (blocked_us)
+        __atomic_fetch_add(blocked_us, os_get_usec_clock() - t0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// An O_WRITE_BLOCK writer found no space. The first call only counts the writer in so
+// it retries once before sleeping, later ones wait for a reader. Returns 0 on timeout.
+static int io_wr_wait(IO_STREAM_REC *pr, int *waiting, int timeout_ms, unsigned int deadline)
+{
+    if (!*waiting)
+    {
+        __atomic_fetch_add(&pr->wr_waiters, 1, __ATOMIC_SEQ_CST);
+        *waiting = 1;
+        return 1;
+    }
+    return io_wait(&pr->sem_wr, timeout_ms, deadline, &io_stat(pr)->wr_block_us);
+}
+
+static void io_wr_done(IO_STREAM_REC *pr, int waiting)
+{
+    if (waiting)
+        __atomic_fetch_sub(&pr->wr_waiters, 1, __ATOMIC_RELAXED);
+}
+
+// need bytes of ring space can never be free at once, so a blocking writer would wait forever
+// a write no amount of free space can store, O_WRITE_BLOCK writers would wait for it forever
+static int io_too_big(IO_STREAM_REC *pr, unsigned long long need)
+{
+    if (IS_BOX(pr))
+        return need != (unsigned int)pr->size;
+    if (IS_MPMC(pr))
+        return need < (unsigned int)pr->size || need % (unsigned int)pr->size;  // whole elements only
+    return need > (IS_SPSC(pr) ? pr->spsc->limit : pr->fifo->limit);
+}
+
+// ring space io_ins takes for len bytes
+static unsigned long long io_ins_need(IO_STREAM_REC *pr, unsigned int len)
+{
+    unsigned long long need = len;
+    unsigned int v = len;
+    if (IS_FRAMED(pr))
+    {
+        do
+        {
+            need++;
+            v >>= 7;
+        }
+        while (v);
+        if (IS_STAMPED(pr))
+            need += IO_TS_LEN;
+    }
+    else if (IS_STAMPED(pr))
+    {
+        // less than an element is never stored
+        need = len < (unsigned int)pr->size ? ~0ULL : (unsigned long long)(len / pr->size) * (pr->size + IO_TS_LEN);
+    }
+    return need;
+}
+
+// blocking streams wait until len bytes are available
+static int io_wait_data(IO_STREAM_REC *pr, int len, int timeout_ms)
+{
+    int real_len;
+    SEM_ID *s;
+    unsigned int deadline = os_get_msec_clock() + timeout_ms;
+    if (pr->mode & O_NONBLOCK)
+        return 1;
+    s = pr->sem_select != NULL ? pr->sem_select : &pr->sem;
+    while ((real_len = io_data_len(pr)) < len)
+    {
+        if (pr->size == 1 && real_len > 0)
+            break;
+        if (!io_wait(s, timeout_ms, deadline, &io_stat(pr)->rd_block_us))
+            return 0;
+    }
+    return 1;
+}
+
 int io_init(void *buf, int len)
 {
     IO_DATA *iptr;
@@ -77,6 +695,8 @@ int io_init(void *buf, int len)
     iptr->io_buf = buf;
     iptr->mem_ptr = iptr->io_buf;
     memset(iptr->io_descr, 0, sizeof(iptr->io_descr));
+    memset(iptr->evset, 0, sizeof(iptr->evset));
+    MutexAdd(&iptr->evset_mutex);
     return IO_OK;
 }
 
@@ -84,7 +704,8 @@ int io_open(short id, int cnt, int size, unsigned int mode)
 {
     IO_DATA *iptr = GET_IO_DATA_PTR();
     IO_STREAM_REC *pr;
-    char *p_buf;
+    unsigned long long limit;
+    int esz;
     if (id < 0 || id >= IO_MAX_NUM)
     {
         return IO_ERR;
@@ -102,16 +723,30 @@ int io_open(short id, int cnt, int size, unsigned int mode)
     {
         return IO_ERR;
     }
-    if ((pr->fifo = io_allocate_mem(sizeof(Fifo))) && (p_buf = io_allocate_mem(size * cnt)))
+    if (cnt <= 0 || size < 0 || ((mode & O_FRAMED) && (mode & (O_MPMC | O_OVERWRITE | O_BOX))) ||
+        ((mode & O_TIMESTAMP) && (mode & (O_MPMC | O_OVERWRITE | O_BOX | O_NOCOPY))))
     {
-        fifo_InitFifo(pr->fifo, (unsigned char *)p_buf, size * cnt);
-
-        pr->fifo->id = id;
-        pr->cnt = cnt;
+        return IO_ERR;
+    }
+    // stamped elements are stored with their write time
+    esz = (mode & O_TIMESTAMP) && !(mode & O_FRAMED) ? size + (int)IO_TS_LEN : size;
+    limit = io_alloc_ring(pr, cnt, esz, &mode);
+    if ((mode & O_TIMESTAMP) && limit && (pr->lat = io_allocate_aligned(sizeof(Hist), 8)) == NULL)
+        limit = 0;
+    if (limit && limit / esz <= 0x7fffffff)
+    {
+        if (pr->fifo)
+            pr->fifo->id = id;
+        if (pr->lat)
+            hist_Init(pr->lat);
+        pr->cnt = (int)(limit / esz);
         pr->size = size;
-        *(unsigned int *)&pr->mode = mode;
+        pr->mode = mode;
         SemaphoreInit(&pr->sem_op);
         SemaphoreInit(&pr->sem);
+        SemaphoreInit(&pr->sem_wr);
+        SemaphoreLock(&pr->sem_wr, 0);
+        pr->wr_waiters = 0;
         pr->sem_select = NULL;
         pr->id = id;
 
@@ -129,6 +764,11 @@ int io_open(short id, int cnt, int size, unsigned int mode)
 }
 
 int io_read(short id, void *buf, int len)
+{
+    return io_read_timeout(id, buf, len, 0);
+}
+
+int io_read_timeout(short id, void *buf, int len, int timeout_ms)
 {
     int ret;
     IO_STREAM_REC *pr;
@@ -140,32 +780,76 @@ int io_read(short id, void *buf, int len)
     pr = GET_IO_REC_PTR(id);
     if (IS_OPENED(pr))
     {
-        if (pr->mode & O_NONBLOCK)
+        int ready;
+        OS_TRACE(TRACE_IO_READ, id, buf, len);
+        ready = io_wait_data(pr, IS_FRAMED(pr) ? 1 : len, timeout_ms);
+        ret = io_extr(pr, buf, len);
+        if (ret > 0)
         {
-            ret = fifo_ExtrBlock(pr->fifo, (unsigned char *)buf, len);
-        }
-        else
-        {
-            int real_len;
-            SEM_ID *s;
-            s = pr->sem_select != NULL ? pr->sem_select : &pr->sem;
-            while ((real_len = fifo_GetDataLen(pr->fifo)) < len)
-            {
-                if (pr->size == 1 && real_len > 0)
-                    break;
-                SemaphoreLock(s, 0);
-            }
-            ret = fifo_ExtrBlock(pr->fifo, (unsigned char *)buf, len);
+            io_stat_out(pr, ret, 1);
+            io_notify_space(pr);
         }
+        else if (!ready)
+            ret = IO_TIMEOUT;
+        OS_TRACE(TRACE_IO_READ_END, id, buf, ret);
         return (ret);
     }
     return IO_ERR;
 }
 
+int io_read_peek(short id, int len, IO_SPAN *span)
+{
+    IO_STREAM_REC *pr;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (id < 0 || id >= IO_MAX_NUM || span == NULL)
+    {
+        return IO_ERR;
+    }
+    pr = GET_IO_REC_PTR(id);
+    if (IS_OPENED(pr) && !IS_MPMC(pr) && !IS_FRAMED(pr) && !IS_BOX(pr) && !IS_STAMPED(pr))
+    {
+        io_wait_data(pr, len, 0);
+        if (IS_SPSC(pr))
+            return spsc_ReadPeek(pr->spsc, len, span);
+        return fifo_ReadPeek(pr->fifo, len, span);
+    }
+    return IO_ERR;
+}
+
+int io_read_release(short id, const IO_SPAN *span, int len)
+{
+    IO_STREAM_REC *pr;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (id < 0 || id >= IO_MAX_NUM || span == NULL || len < 0)
+    {
+        return IO_ERR;
+    }
+    pr = GET_IO_REC_PTR(id);
+    if (IS_OPENED(pr) && !IS_MPMC(pr) && !IS_FRAMED(pr) && !IS_BOX(pr) && !IS_STAMPED(pr))
+    {
+        if (IS_SPSC(pr))
+            spsc_ReadRelease(pr->spsc, span, len);
+        else
+            fifo_ReadRelease(pr->fifo, span, len);
+        if (len > 0)
+            io_stat_out(pr, len, 1);
+        io_notify_space(pr);
+        return IO_OK;
+    }
+    return IO_ERR;
+}
+
 int io_write(short id, const void *buf, int len)
+{
+    return io_write_timeout(id, buf, len, 0);
+}
+
+int io_write_timeout(short id, const void *buf, int len, int timeout_ms)
 {
     IO_STREAM_REC *pr;
     int ret;
+    int waiting = 0;
+    unsigned int deadline;
     IO_DATA *iptr = GET_IO_DATA_PTR();
     if (id < 0 || id >= IO_MAX_NUM)
     {
@@ -177,22 +861,172 @@ int io_write(short id, const void *buf, int len)
     pr = GET_IO_REC_PTR(id);
     if (IS_OPENED(pr))
     {
-        // Don't add element if pipe is full
-        ret = fifo_InsBlock(pr->fifo, (unsigned char *)buf, len);
-        if (!(pr->mode & O_NONBLOCK) || pr->sem_select != NULL)
+        if ((pr->mode & O_WRITE_BLOCK) && io_too_big(pr, io_ins_need(pr, len)))
+            return IS_FRAMED(pr) ? IO_MSGSIZE : IO_ERR;
+        OS_TRACE(TRACE_IO_WRITE, id, buf, len);
+        // Don't add element if pipe is full, unless writers block
+        deadline = os_get_msec_clock() + timeout_ms;
+        while ((ret = io_ins(pr, buf, len)) == 0 && (pr->mode & O_WRITE_BLOCK))
+        {
+            if (!io_wr_wait(pr, &waiting, timeout_ms, deadline))
+            {
+                io_wr_done(pr, waiting);
+                OS_TRACE(TRACE_IO_WRITE_END, id, buf, IO_TIMEOUT);
+                return IO_TIMEOUT;
+            }
+        }
+        io_wr_done(pr, waiting);
+        if (ret == 0)
+            OS_TRACE(TRACE_IO_DROP, id, buf, len);
+        io_stat_in(pr, ret, 1);
+        io_notify(pr);
+        OS_TRACE(TRACE_IO_WRITE_END, id, buf, ret);
+        return (ret);
+    }
+    return IO_ERR;
+}
+
+int io_writev(short id, const void **buf, const unsigned int *len, int cnt)
+{
+    return io_writev_timeout(id, buf, len, cnt, 0);
+}
+
+// All cnt blocks are written with one reservation or none is,
+// O_MPMC streams take them element by element and may stop early
+int io_writev_timeout(short id, const void **buf, const unsigned int *len, int cnt, int timeout_ms)
+{
+    IO_STREAM_REC *pr;
+    int ret, i;
+    int waiting = 0;
+    unsigned long long total = 0;
+    unsigned int deadline;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (id < 0 || id >= IO_MAX_NUM || buf == NULL || len == NULL)
+    {
+        return IO_ERR;
+    }
+    if (cnt <= 0)
+        return (0);
+
+    pr = GET_IO_REC_PTR(id);
+    if (IS_OPENED(pr) && !IS_FRAMED(pr) && !IS_BOX(pr) && !IS_STAMPED(pr))
+    {
+        for (i = 0; i < cnt; i++)
         {
-            SEM_ID *sem;
-            sem = pr->sem_select != NULL ? pr->sem_select : &pr->sem;
-            SemaphoreUnlock(sem);
+            // one slot per element
+            if ((pr->mode & O_WRITE_BLOCK) && IS_MPMC(pr) && len[i] != (unsigned int)pr->size)
+                return IO_ERR;
+            total += len[i];
         }
+        if ((pr->mode & O_WRITE_BLOCK) && io_too_big(pr, total))
+            return IO_ERR;
+        deadline = os_get_msec_clock() + timeout_ms;
+        while ((ret = io_insv(pr, buf, len, cnt)) == 0 && (pr->mode & O_WRITE_BLOCK))
+        {
+            if (!io_wr_wait(pr, &waiting, timeout_ms, deadline))
+            {
+                io_wr_done(pr, waiting);
+                return IO_TIMEOUT;
+            }
+        }
+        io_wr_done(pr, waiting);
+        io_stat_in(pr, ret, io_stat_blocks(len, ret));
+        io_notify(pr);
+        return (ret);
+    }
+    return IO_ERR;
+}
+
+int io_readv(short id, void **buf, const unsigned int *len, int cnt)
+{
+    return io_readv_timeout(id, buf, len, cnt, 0);
+}
 
-        if (pr->handler)
-            pr->handler(id);
+// Reads as many whole blocks as available, returns the number of bytes
+int io_readv_timeout(short id, void **buf, const unsigned int *len, int cnt, int timeout_ms)
+{
+    int ret, ready;
+    IO_STREAM_REC *pr;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (id < 0 || id >= IO_MAX_NUM || buf == NULL || len == NULL)
+    {
+        return IO_ERR;
+    }
+    if (cnt <= 0)
+        return (0);
+    pr = GET_IO_REC_PTR(id);
+    if (IS_OPENED(pr) && !IS_FRAMED(pr) && !IS_BOX(pr) && !IS_STAMPED(pr))
+    {
+        ready = io_wait_data(pr, len[0], timeout_ms);
+        ret = io_extrv(pr, buf, len, cnt);
+        if (ret > 0)
+        {
+            io_stat_out(pr, ret, io_stat_blocks(len, ret));
+            io_notify_space(pr);
+        }
+        else if (!ready)
+            ret = IO_TIMEOUT;
         return (ret);
     }
     return IO_ERR;
 }
 
+int io_write_reserve(short id, int len, IO_SPAN *span)
+{
+    IO_STREAM_REC *pr;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (id < 0 || id >= IO_MAX_NUM || span == NULL)
+    {
+        return IO_ERR;
+    }
+    if (len <= 0)
+        return (0);
+
+    pr = GET_IO_REC_PTR(id);
+    if (IS_OPENED(pr) && (pr->mode & O_NOCOPY) && !IS_MPMC(pr) && !IS_FRAMED(pr) && !IS_BOX(pr))
+    {
+        int ret;
+        int waiting = 0;
+        if ((pr->mode & O_WRITE_BLOCK) && io_too_big(pr, (unsigned int)len))
+            return IO_ERR;
+        // All or nothing, the span is split in two at the ring end unless the stream is O_MIRROR
+        while ((ret = IS_SPSC(pr) ? spsc_WriteReserve(pr->spsc, len, span) : fifo_WriteReserve(pr->fifo, len, span)) ==
+                   0 &&
+               (pr->mode & O_WRITE_BLOCK))
+        {
+            io_wr_wait(pr, &waiting, 0, 0);
+        }
+        io_wr_done(pr, waiting);
+        if (ret == 0)
+            io_stat_in(pr, 0, 0);
+        return ret;
+    }
+    return IO_ERR;
+}
+
+int io_write_commit(short id, const IO_SPAN *span)
+{
+    IO_STREAM_REC *pr;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    if (id < 0 || id >= IO_MAX_NUM || span == NULL)
+    {
+        return IO_ERR;
+    }
+
+    pr = GET_IO_REC_PTR(id);
+    if (IS_OPENED(pr) && (pr->mode & O_NOCOPY) && !IS_MPMC(pr) && !IS_FRAMED(pr) && !IS_BOX(pr))
+    {
+        if (IS_SPSC(pr))
+            spsc_WriteCommit(pr->spsc, span);
+        else
+            fifo_WriteCommit(pr->fifo, span);
+        io_stat_in(pr, span->len[0] + span->len[1], 1);
+        io_notify(pr);
+        return (span->len[0] + span->len[1]);
+    }
+    return IO_ERR;
+}
+
 int io_select(int rds_count, short rds_arr[], short *rds_res, int timeout)
 {
     IO_STREAM_REC *pr;
@@ -201,6 +1035,7 @@ int io_select(int rds_count, short rds_arr[], short *rds_res, int timeout)
     SEM_ID *s = 0;
     int res = IO_UNDEF;
 
+    OS_TRACE(TRACE_IO_SELECT, -1, rds_arr, rds_count);
     if (rds_res)
         *rds_res = IO_MAX_NUM;
     for (i = 0; i < rds_count; ++i)
@@ -223,7 +1058,7 @@ int io_select(int rds_count, short rds_arr[], short *rds_res, int timeout)
             s = &pr->sem;
 
         pr->sem_select = s;
-        if (fifo_GetDataLen(pr->fifo) >= pr->size)
+        if (io_readable(pr))
         {
             if (rds_res)
                 *rds_res = i;
@@ -252,7 +1087,7 @@ int io_select(int rds_count, short rds_arr[], short *rds_res, int timeout)
             continue;
         }
 
-        if (res == IO_UNDEF && fifo_GetDataLen(pr->fifo) >= pr->size)
+        if (res == IO_UNDEF && io_readable(pr))
         {
             res = IO_OK;
             if (rds_res && *rds_res == IO_MAX_NUM)
@@ -262,6 +1097,7 @@ int io_select(int rds_count, short rds_arr[], short *rds_res, int timeout)
         pr->sem_select = NULL;
     }
 
+    OS_TRACE(TRACE_IO_SELECT_END, -1, rds_arr, res);
     return (res);
 }
 
@@ -287,14 +1123,15 @@ int io_ioctl(short id, int cmd, ...)
             case IO_CMD_GET_DATA_COUNT:
             {
                 unsigned int *res = va_arg(arg, unsigned int *);
-                *res = fifo_GetDataLen(pr->fifo);
+                *res = io_data_len(pr);
                 break;
             }
 
             case IO_CMD_GET_FREE_SIZE:
             {
                 unsigned int *res = va_arg(arg, unsigned int *);
-                *res = (pr->size * pr->cnt) - fifo_GetDataLen(pr->fifo);
+                unsigned long long len = (unsigned long long)pr->size * pr->cnt - io_data_len(pr);
+                *res = len > 0x7fffffff ? 0x7fffffff : (unsigned int)len;
                 break;
             }
 
@@ -304,6 +1141,51 @@ int io_ioctl(short id, int cmd, ...)
                 *res = pr->size;
                 break;
             }
+
+            case IO_CMD_GET_MSG_SIZE:
+            {
+                unsigned int *res = va_arg(arg, unsigned int *);
+                IO_SPAN span;
+                unsigned int hlen;
+                *res = 0;
+                if (IS_FRAMED(pr) && io_peek_record(pr, &span, &hlen, res))
+                    io_release(pr, &span, 0);
+                break;
+            }
+
+            case IO_CMD_GET_STATS:
+            {
+                IO_STATS *res = va_arg(arg, IO_STATS *);
+                io_get_stats(pr, res);
+                break;
+            }
+
+            case IO_CMD_GET_LATENCY:
+            {
+                IO_LATENCY *res = va_arg(arg, IO_LATENCY *);
+                memset(res, 0, sizeof(*res));
+                if (pr->lat)
+                {
+                    res->cnt = hist_GetCount(pr->lat);
+                    res->mean = hist_GetMean(pr->lat);
+                    res->max = hist_GetMax(pr->lat);
+                    res->p50 = hist_Percentile(pr->lat, 0.5);
+                    res->p99 = hist_Percentile(pr->lat, 0.99);
+                    res->p999 = hist_Percentile(pr->lat, 0.999);
+                }
+                break;
+            }
+
+            case IO_CMD_RESET:
+                io_reset_stats(pr);
+                break;
+
+            case IO_CMD_GET_DROP_COUNT:
+            {
+                unsigned long long *res = va_arg(arg, unsigned long long *);
+                *res = IS_MPMC(pr) ? mpmc_GetDropped(pr->mpmc) : 0;
+                break;
+            }
         }
 
         res = IO_OK;
@@ -311,3 +1193,170 @@ int io_ioctl(short id, int cmd, ...)
     va_end(arg);
     return (res);
 }
+
+int io_evset_create(void)
+{
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    int i;
+    int res = IO_ERR;
+
+    MutexLock(&iptr->evset_mutex);
+    for (i = 0; i < IO_EVSET_NUM; ++i)
+    {
+        IO_EVSET_REC *es = &iptr->evset[i];
+        if (!es->used)
+        {
+            es->used = 1;
+            es->head = es->tail = -1;
+            MutexAdd(&es->mutex);
+            SemaphoreInit(&es->sem);
+            SemaphoreLock(&es->sem, 0);
+            res = i;
+            break;
+        }
+    }
+    MutexUnlock(&iptr->evset_mutex);
+    return (res);
+}
+
+int io_evset_add(int set, short id, unsigned int events)
+{
+    IO_STREAM_REC *pr;
+    IO_EVSET_REC *es;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    unsigned short ev;
+
+    if (id < 0 || id >= IO_MAX_NUM || set < 0 || set >= IO_EVSET_NUM || !iptr->evset[set].used)
+    {
+        return IO_ERR;
+    }
+    pr = GET_IO_REC_PTR(id);
+    es = &iptr->evset[set];
+    if (!IS_OPENED(pr) || (pr->ev_set && pr->ev_set != set + 1))
+    {
+        return IO_ERR;
+    }
+    MutexLock(&es->mutex);
+    pr->ev_mask = events & (IO_EV_READ | IO_EV_WRITE | IO_EV_EDGE);
+    pr->ev_pending = 0;
+    pr->ev_set = set + 1;
+    // report what is ready already
+    ev = io_ev_state(pr) & pr->ev_mask;
+    if (ev)
+    {
+        pr->ev_pending = ev;
+        io_ev_enqueue(es, pr);
+    }
+    MutexUnlock(&es->mutex);
+    if (ev)
+        SemaphoreUnlock(&es->sem);
+    return IO_OK;
+}
+
+int io_evset_del(int set, short id)
+{
+    IO_STREAM_REC *pr;
+    IO_EVSET_REC *es;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    short *pp;
+
+    if (id < 0 || id >= IO_MAX_NUM || set < 0 || set >= IO_EVSET_NUM)
+    {
+        return IO_ERR;
+    }
+    pr = GET_IO_REC_PTR(id);
+    es = &iptr->evset[set];
+    if (pr->ev_set != set + 1)
+    {
+        return IO_ERR;
+    }
+    MutexLock(&es->mutex);
+    pr->ev_set = 0;
+    pr->ev_mask = 0;
+    if (pr->ev_queued)
+    {
+        short prev = -1;
+        for (pp = &es->head; *pp != id; pp = &GET_IO_REC_PTR(*pp)->ev_next)
+            prev = *pp;
+        *pp = pr->ev_next;
+        if (es->tail == id)
+            es->tail = prev;
+        pr->ev_queued = 0;
+    }
+    pr->ev_pending = 0;
+    MutexUnlock(&es->mutex);
+    return IO_OK;
+}
+
+// Returns the number of events stored to ev, 0 on timeout.
+// Level triggered streams that are still ready stay on the ready list.
+int io_evset_wait(int set, IO_EVENT *ev, int max, int timeout_ms)
+{
+    IO_STREAM_REC *pr;
+    IO_EVSET_REC *es;
+    IO_DATA *iptr = GET_IO_DATA_PTR();
+    unsigned int deadline = os_get_msec_clock() + timeout_ms;
+    short requeue = -1, requeue_tail = -1;
+    int n = 0;
+
+    if (set < 0 || set >= IO_EVSET_NUM || !iptr->evset[set].used || ev == NULL || max <= 0)
+    {
+        return IO_ERR;
+    }
+    es = &iptr->evset[set];
+    for (;;)
+    {
+        MutexLock(&es->mutex);
+        while (n < max && es->head >= 0)
+        {
+            unsigned short ready;
+            pr = GET_IO_REC_PTR(es->head);
+            es->head = pr->ev_next;
+            if (es->head < 0)
+                es->tail = -1;
+            pr->ev_queued = 0;
+
+            if (pr->ev_mask & IO_EV_EDGE)
+            {
+                ready = pr->ev_pending & pr->ev_mask;
+                pr->ev_pending = 0;
+            }
+            else
+            {
+                ready = io_ev_state(pr) & pr->ev_mask;
+                pr->ev_pending = ready;
+                if (ready)
+                {
+                    // keep it queued, after this round
+                    pr->ev_queued = 1;
+                    pr->ev_next = -1;
+                    if (requeue_tail < 0)
+                        requeue = pr->id;
+                    else
+                        GET_IO_REC_PTR(requeue_tail)->ev_next = pr->id;
+                    requeue_tail = pr->id;
+                }
+            }
+            if (ready)
+            {
+                ev[n].id = pr->id;
+                ev[n].events = ready;
+                n++;
+            }
+        }
+        if (requeue >= 0)
+        {
+            if (es->tail < 0)
+                es->head = requeue;
+            else
+                GET_IO_REC_PTR(es->tail)->ev_next = requeue;
+            es->tail = requeue_tail;
+            requeue = requeue_tail = -1;
+        }
+        MutexUnlock(&es->mutex);
+        if (n > 0)
+            return n;
+        if (!io_wait(&es->sem, timeout_ms, deadline, NULL))
+            return 0;
+    }
+}
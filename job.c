@@ -0,0 +1,321 @@
+/*
+ * job.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "rtos.h"
+#include "mpmc.h"
+#include "futex.h"
+#include "green.h"
+
+#define JOB_MAX_WORKERS 64
+#define JOB_DEQUE_LEN 4096  // power of two
+#define JOB_INJECT_LEN 4096
+#define JOB_SPIN 64  // rounds of stealing before a worker sleeps
+
+typedef struct
+{
+    void (*fn)(void *);
+    void *arg;
+    OS_WAITGROUP *wg;
+} JOB;
+
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves steal from the top
+typedef struct
+{
+    volatile long long top __attribute__((aligned(MPMC_CACHE_LINE)));
+    volatile long long bottom __attribute__((aligned(MPMC_CACHE_LINE)));
+    JOB *volatile buf[JOB_DEQUE_LEN];
+    // owner only
+    OS_JOB_STATS stats __attribute__((aligned(MPMC_CACHE_LINE)));
+    unsigned int seed;
+} JOB_WORKER;
+
+static JOB_WORKER *job_workers;
+static int job_worker_num;
+static MpmcQueue job_inject;  // jobs submitted from outside the pool
+static volatile int job_sleepers;
+static SEM_ID job_sem;
+
+static __thread int job_self = -1;
+
+static int job_push(JOB_WORKER *w, JOB *j)
+{
+    long long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    if (b - t >= JOB_DEQUE_LEN)
+        return -1;
+    __atomic_store_n(&w->buf[b & (JOB_DEQUE_LEN - 1)], j, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static JOB *job_take(JOB_WORKER *w)
+{
+    long long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    long long t;
+    JOB *j = NULL;
+
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+    if (t <= b)
+    {
+        j = __atomic_load_n(&w->buf[b & (JOB_DEQUE_LEN - 1)], __ATOMIC_RELAXED);
+        if (t == b)
+        {
+            // last job, race the thieves for it
+            if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                j = NULL;
+            __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return j;
+}
+
+static JOB *job_steal(JOB_WORKER *w)
+{
+    long long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    long long b;
+    JOB *j;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    j = __atomic_load_n(&w->buf[t & (JOB_DEQUE_LEN - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return j;
+}
+
+static void job_run(JOB *j)
+{
+    OS_WAITGROUP *wg = j->wg;
+    j->fn(j->arg);
+    free(j);
+    // a waiter may return and drop wg as soon as cnt reads 0, so only its address is used after that
+    if (wg && __atomic_sub_fetch(&wg->cnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        futex_wake(&wg->cnt, INT_MAX, FUTEX_BITSET_MATCH_ANY);
+        green_futex_wake((const void *)&wg->cnt);
+    }
+}
+
+// Next job for worker self: its own deque, then the injected jobs, then a random victim
+static JOB *job_find(int self)
+{
+    JOB_WORKER *w = &job_workers[self];
+    JOB *j = NULL;
+    int i, v, n;
+
+    if ((j = job_take(w)) != NULL)
+        return j;
+    if (mpmc_Pop(&job_inject, &j))
+        return j;
+    n = __atomic_load_n(&job_worker_num, __ATOMIC_ACQUIRE);
+    v = (int)(rand_r(&w->seed) % n);
+    for (i = 0; i < n; i++, v = (v + 1) % n)
+    {
+        if (v == self)
+            continue;
+        if ((j = job_steal(&job_workers[v])) != NULL)
+        {
+            w->stats.steals++;
+            return j;
+        }
+    }
+    w->stats.steal_fails++;
+    return NULL;
+}
+
+static int job_pending(void)
+{
+    int i;
+    if (mpmc_GetDataLen(&job_inject))
+        return 1;
+    for (i = 0; i < job_worker_num; i++)
+    {
+        if (__atomic_load_n(&job_workers[i].bottom, __ATOMIC_ACQUIRE) >
+            __atomic_load_n(&job_workers[i].top, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+    return 0;
+}
+
+static void job_worker(void *p)
+{
+    int self = (int)(long)p;
+    JOB_WORKER *w = &job_workers[self];
+    JOB *j;
+    int spin = 0;
+
+    job_self = self;
+    for (;;)
+    {
+        if ((j = job_find(self)) != NULL)
+        {
+            w->stats.jobs++;
+            job_run(j);
+            spin = 0;
+            continue;
+        }
+        if (++spin < JOB_SPIN)
+        {
+            sched_yield();
+            continue;
+        }
+        // sleep, a submitter seeing job_sleepers > 0 posts job_sem
+        __atomic_fetch_add(&job_sleepers, 1, __ATOMIC_SEQ_CST);
+        if (!job_pending())
+        {
+            w->stats.idles++;
+            SemaphoreLock(&job_sem, 0);
+        }
+        __atomic_fetch_sub(&job_sleepers, 1, __ATOMIC_SEQ_CST);
+        spin = 0;
+    }
+}
+
+static void job_wake(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&job_sleepers, __ATOMIC_RELAXED) > 0)
+        SemaphoreUnlock(&job_sem);
+}
+
+// Start the pool, workers <= 0 starts one per online CPU.
+// Returns -1 if no worker could be started, the pool may end up with fewer workers than asked.
+int os_job_init(int workers)
+{
+    void *buf, *mem;
+    OS_TASK_ATTR attr;
+    char name[16];
+    int i;
+
+    if (job_workers)
+        return 0;
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+    if (workers > JOB_MAX_WORKERS)
+        workers = JOB_MAX_WORKERS;
+    if ((buf = malloc(mpmc_BufSize(JOB_INJECT_LEN, sizeof(JOB *)))) == NULL)
+        return -1;
+    if (posix_memalign(&mem, MPMC_CACHE_LINE, workers * sizeof(JOB_WORKER)))
+    {
+        free(buf);
+        return -1;
+    }
+    mpmc_InitQueue(&job_inject, buf, JOB_INJECT_LEN, sizeof(JOB *));
+    SemaphoreInit(&job_sem);
+    SemaphoreLock(&job_sem, 0);
+    memset(mem, 0, workers * sizeof(JOB_WORKER));
+    job_workers = mem;
+    memset(&attr, 0, sizeof(attr));
+    attr.policy = OS_SCHED_OTHER;
+    attr.thread = 1;  // job_self is per thread, workers cannot be green tasks
+    for (i = 0; i < workers; i++)
+    {
+        job_workers[i].seed = i + 1;
+        // counted before it starts, so the worker never sees itself out of range
+        __atomic_store_n(&job_worker_num, i + 1, __ATOMIC_RELEASE);
+        snprintf(name, sizeof(name), "job%d", i);
+        if (os_create_task_ex(name, job_worker, &attr, (void *)(long)i))
+        {
+            __atomic_store_n(&job_worker_num, i, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    if (i == 0)
+    {
+        job_workers = NULL;
+        free(mem);
+        free(buf);
+        return -1;
+    }
+    if (i < workers)
+        os_printf("os_job_init: %d of %d workers started\n", i, workers);
+    return 0;
+}
+
+// Queue fn(arg), wg if given counts it until it has run.
+// Jobs submitted by a job go to its worker's own deque without locking.
+int os_job_submit(void (*fn)(void *), void *arg, OS_WAITGROUP *wg)
+{
+    JOB *j;
+
+    if (job_workers == NULL || (j = malloc(sizeof(*j))) == NULL)
+        return -1;
+    j->fn = fn;
+    j->arg = arg;
+    j->wg = wg;
+    if (wg)
+        __atomic_add_fetch(&wg->cnt, 1, __ATOMIC_RELAXED);
+    if (job_self >= 0 ? job_push(&job_workers[job_self], j) : !mpmc_Push(&job_inject, &j))
+    {
+        // the queue is full, run it here
+        job_run(j);
+        return 0;
+    }
+    job_wake();
+    return 0;
+}
+
+void os_wg_init(OS_WAITGROUP *wg)
+{
+    wg->cnt = 0;
+}
+
+// Workers run other jobs while they wait, so fork/join inside a job does not block the pool
+void os_wg_wait(OS_WAITGROUP *wg)
+{
+    unsigned int cnt;
+    JOB *j;
+
+    while ((cnt = __atomic_load_n(&wg->cnt, __ATOMIC_ACQUIRE)) > 0)
+    {
+        if (job_self >= 0)
+        {
+            if ((j = job_find(job_self)) != NULL)
+            {
+                job_workers[job_self].stats.jobs++;
+                job_run(j);
+            }
+            else
+            {
+                sched_yield();
+            }
+            continue;
+        }
+        if (green_active())
+            green_futex_wait(&wg->cnt, cnt, 0);
+        else
+            futex_wait(&wg->cnt, cnt, 0, FUTEX_BITSET_MATCH_ANY);
+    }
+}
+
+// Returns the number of workers, st may be NULL
+int os_job_get_stats(int worker, OS_JOB_STATS *st)
+{
+    if (st && worker >= 0 && worker < job_worker_num)
+    {
+        const OS_JOB_STATS *s = &job_workers[worker].stats;
+        st->jobs = __atomic_load_n(&s->jobs, __ATOMIC_RELAXED);
+        st->steals = __atomic_load_n(&s->steals, __ATOMIC_RELAXED);
+        st->steal_fails = __atomic_load_n(&s->steal_fails, __ATOMIC_RELAXED);
+        st->idles = __atomic_load_n(&s->idles, __ATOMIC_RELAXED);
+    }
+    return job_worker_num;
+}
@@ -0,0 +1,231 @@
+/*
+ * log.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "rtos.h"
+#include "spsc.h"
+
+#define LOG_MAX_RINGS 64
+#define LOG_RING_SIZE 0x10000
+#define LOG_FLUSH_MS 10
+
+// One ring per thread, the thread is its only writer and the drain its only reader
+typedef struct
+{
+    SpscFifo fifo;
+    volatile unsigned long long dropped;
+    unsigned long long reported;  // drops already noted in the output
+    volatile int unused;  // the thread exited, another one takes the ring once it is drained
+} LOG_RING;
+
+static LOG_RING *volatile log_rings[LOG_MAX_RINGS];
+static volatile int log_ring_num;
+static unsigned int log_ring_size;
+static volatile int log_on;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_key;
+
+static __thread LOG_RING *log_ring;
+static __thread int log_no_ring;
+
+// pthread_key destructor, the ring outlives its thread until the drain has written it out
+static void log_put_ring(void *p)
+{
+    LOG_RING *r = p;
+    log_ring = NULL;  // later destructors print synchronously
+    __atomic_store_n(&r->unused, 1, __ATOMIC_RELEASE);
+}
+
+static LOG_RING *log_reuse_ring(void)
+{
+    int i, n = __atomic_load_n(&log_ring_num, __ATOMIC_ACQUIRE);
+    if (n > LOG_MAX_RINGS)
+        n = LOG_MAX_RINGS;
+    for (i = 0; i < n; i++)
+    {
+        LOG_RING *r = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        int unused = 1;
+        if (r && __atomic_load_n(&r->unused, __ATOMIC_ACQUIRE) && spsc_GetDataLen(&r->fifo) == 0 &&
+            __atomic_compare_exchange_n(&r->unused, &unused, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return r;
+    }
+    return NULL;
+}
+
+static LOG_RING *log_get_ring(void)
+{
+    LOG_RING *r;
+    void *buf;
+    int n;
+
+    if (log_ring || log_no_ring)
+        return log_ring;
+    log_no_ring = 1;
+    if ((r = log_reuse_ring()) != NULL)
+    {
+        pthread_setspecific(log_key, r);
+        log_ring = r;
+        return r;
+    }
+    if (posix_memalign((void **)&r, SPSC_CACHE_LINE, sizeof(*r)))
+        return NULL;
+    if ((buf = malloc(log_ring_size)) == NULL ||
+        (n = __atomic_fetch_add(&log_ring_num, 1, __ATOMIC_RELAXED)) >= LOG_MAX_RINGS)
+    {
+        // too many threads log, this one stays synchronous
+        free(buf);
+        free(r);
+        return NULL;
+    }
+    spsc_InitFifo(&r->fifo, buf, log_ring_size);
+    r->dropped = 0;
+    r->reported = 0;
+    r->unused = 0;
+    pthread_setspecific(log_key, r);
+    __atomic_store_n(&log_rings[n], r, __ATOMIC_RELEASE);
+    log_ring = r;
+    return r;
+}
+
+static void log_writev_all(struct iovec *iov, int cnt)
+{
+    ssize_t n;
+    while (cnt > 0)
+    {
+        n = writev(2, iov, cnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Writes out everything queued with one writev, the rings hold whole lines only
+static void log_drain(void)
+{
+    struct iovec iov[LOG_MAX_RINGS * 2 + 1];
+    IO_SPAN span[LOG_MAX_RINGS];
+    LOG_RING *ring[LOG_MAX_RINGS];
+    char note[64];
+    unsigned long long dropped = 0, d;
+    int i, n, cnt = 0, rings = 0;
+
+    pthread_mutex_lock(&log_drain_mutex);
+    n = __atomic_load_n(&log_ring_num, __ATOMIC_ACQUIRE);
+    if (n > LOG_MAX_RINGS)
+        n = LOG_MAX_RINGS;
+    for (i = 0; i < n; i++)
+    {
+        LOG_RING *r = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (r == NULL)
+            continue;
+        d = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        dropped += d - r->reported;
+        r->reported = d;
+        if (spsc_ReadPeek(&r->fifo, 0xffffffff, &span[rings]) == 0)
+            continue;
+        iov[cnt].iov_base = span[rings].ptr[0];
+        iov[cnt++].iov_len = span[rings].len[0];
+        if (span[rings].len[1])
+        {
+            iov[cnt].iov_base = span[rings].ptr[1];
+            iov[cnt++].iov_len = span[rings].len[1];
+        }
+        ring[rings++] = r;
+    }
+    if (dropped)
+    {
+        iov[cnt].iov_base = note;
+        iov[cnt++].iov_len = snprintf(note, sizeof(note), "[log] %llu lines dropped\n", dropped);
+    }
+    log_writev_all(iov, cnt);
+    for (i = 0; i < rings; i++)
+        spsc_ReadRelease(&ring[i]->fifo, &span[i], span[i].len[0] + span[i].len[1]);
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+static void *log_thread(void *p)
+{
+    (void)p;
+    for (;;)
+    {
+        log_drain();
+        usleep(LOG_FLUSH_MS * 1000);
+    }
+    return 0;
+}
+
+// Queue a formatted line, returns 0 if the caller has to write it itself
+int os_log_write(const char *buf, int len)
+{
+    LOG_RING *r;
+    if (!log_on || (r = log_get_ring()) == NULL)
+        return 0;
+    if (spsc_InsBlock(&r->fifo, buf, len) != (unsigned int)len)
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Switch os_printf to per-thread rings drained by a logger thread,
+// ring_size <= 0 selects the default
+int os_log_start(int ring_size)
+{
+    pthread_t thread;
+    if (log_on)
+        return 0;
+    log_ring_size = ring_size > 0 ? (unsigned int)ring_size : LOG_RING_SIZE;
+    if (pthread_key_create(&log_key, log_put_ring))
+        return -1;
+    if (pthread_create(&thread, NULL, log_thread, NULL))
+    {
+        pthread_key_delete(log_key);
+        return -1;
+    }
+    pthread_detach(thread);
+    log_on = 1;
+    // the logger thread may be asleep with lines queued when the process exits
+    atexit(os_log_flush);
+    return 0;
+}
+
+void os_log_flush(void)
+{
+    if (log_on)
+        log_drain();
+}
+
+unsigned long long os_log_get_dropped(void)
+{
+    unsigned long long dropped = 0;
+    int i, n = __atomic_load_n(&log_ring_num, __ATOMIC_ACQUIRE);
+    if (n > LOG_MAX_RINGS)
+        n = LOG_MAX_RINGS;
+    for (i = 0; i < n; i++)
+    {
+        LOG_RING *r = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (r)
+            dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
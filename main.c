@@ -92,14 +92,31 @@ void test_io_task(void *p)
                 // all reads first, then one write
                 do
                 {
+                    IO_SPAN span;
+                    // parse the message in place, copy only if it wraps
 #ifdef USE_IO
-                    len = io_read(rd_num, buf, BLOCK_SIZE);
+                    len = io_read_peek(rd_num, BLOCK_SIZE, &span);
 #else
-                    len = fifo_ExtrBlock(fifos[rd_num], buf, BLOCK_SIZE);
+                    len = fifo_ReadPeek(fifos[rd_num], BLOCK_SIZE, &span);
 #endif
                     if (len == BLOCK_SIZE)
                     {
-                        check_buf(rd_num, buf, len, prev_num);
+                        char *s = span.ptr[0];
+                        if (span.len[1])
+                        {
+                            memcpy(buf, span.ptr[0], span.len[0]);
+                            memcpy(buf + span.len[0], span.ptr[1], span.len[1]);
+                            s = buf;
+                        }
+                        check_buf(rd_num, s, len, prev_num);
+                    }
+                    if (len > 0)
+                    {
+#ifdef USE_IO
+                        io_read_release(rd_num, &span, len);
+#else
+                        fifo_ReadRelease(fifos[rd_num], &span, len);
+#endif
                     }
                 }
                 while (len == BLOCK_SIZE);
@@ -172,6 +189,16 @@ int main(void)
             os_printf("%2d %12lu %12lu %8lu %8lu %8lu\n", i, reads_cnt[i], writes_cnt[i], errs_cnt[i], miss_cnt[i],
                       write0_cnt[i]);
         }
+#ifdef USE_IO
+        os_printf("##   msgs_in     msgs_out    drops    hwm   rd_wait_us  contention\n");
+        for (i = 1; i < MAX_PIPES; i++)
+        {
+            IO_STATS st;
+            io_ioctl(i, IO_CMD_GET_STATS, &st);
+            os_printf("%2d %10llu %12llu %8llu %6llu %12llu %11llu\n", i, st.msgs_in, st.msgs_out, st.drops,
+                      st.high_water, st.rd_block_us, st.rd_contention);
+        }
+#endif
         os_sleep_ms(1000);
     }
     return 0;
@@ -0,0 +1,225 @@
+#include <string.h>
+#include <stddef.h>
+
+#include "mpmc.h"
+
+#define cpmem memcpy
+#define zmem(p, sz) memset((p), 0, (sz))
+
+#define MPMC_SEQ(q, pos) ((volatile unsigned long long *)((q)->buf + ((pos) % (q)->cnt) * (q)->slot))
+#define MPMC_DATA(seq) ((unsigned char *)(seq) + sizeof(unsigned long long))
+
+unsigned int mpmc_BufSize(unsigned int cnt, unsigned int size)
+{
+    return cnt * (unsigned int)(sizeof(unsigned long long) + ((size + 7) & ~7U));
+}
+
+// Lossy mode slot sequence, 4 * (pos + 1) + state for the latest element pos to use the slot
+enum
+{
+    MPMC_LOSSY_DROPPED,  // element pos was given up, the slot is free
+    MPMC_LOSSY_WRITING,
+    MPMC_LOSSY_DONE,
+    MPMC_LOSSY_BUSY  // element pos was given up, an older writer is still copying into the slot
+};
+#define MPMC_LOSSY_SEQ(pos, state) (4 * ((pos) + 1) + (state))
+
+// Never waits for another writer, an element whose slot is still being written is dropped instead
+static unsigned int mpmc_push_overwrite(MpmcQueue *q, const void *pData)
+{
+    unsigned long long pos = __atomic_fetch_add(&q->enq, 1, __ATOMIC_RELAXED);
+    volatile unsigned long long *seq = MPMC_SEQ(q, pos);
+    unsigned long long s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    unsigned long long mine = MPMC_LOSSY_SEQ(pos, MPMC_LOSSY_WRITING);
+
+    for (;;)
+    {
+        // readers count the dropped elements as they skip them
+        if (s >= MPMC_LOSSY_SEQ(pos, 0))
+        {
+            // a writer a full lap ahead took the slot, our element is already stale
+            return q->size;
+        }
+        if ((s & 3) == MPMC_LOSSY_WRITING || (s & 3) == MPMC_LOSSY_BUSY)
+        {
+            // a writer a lap behind is still copying, leave it the slot
+            if (__atomic_compare_exchange_n(seq, &s, MPMC_LOSSY_SEQ(pos, MPMC_LOSSY_BUSY), 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                return q->size;
+            continue;
+        }
+        if (__atomic_compare_exchange_n(seq, &s, mine, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if (pData)
+        cpmem(MPMC_DATA(seq), pData, q->size);
+    s = mine;
+    while (!__atomic_compare_exchange_n(seq, &s, s == mine ? mine + 1 : (s & ~3ULL) + MPMC_LOSSY_DROPPED, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;  // newer writers gave up meanwhile, release the slot on their behalf
+    return q->size;
+}
+
+static unsigned int mpmc_pop_lossy(MpmcQueue *q, void *pBuf)
+{
+    volatile unsigned long long *seq;
+    unsigned long long pos, head, s1, s2;
+
+    for (;;)
+    {
+        pos = __atomic_load_n(&q->deq, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&q->enq, __ATOMIC_ACQUIRE);
+        if (pos >= head)
+            return 0;
+        if (head - pos > q->cnt)
+        {
+            // the writers lapped the readers
+            if (__atomic_compare_exchange_n(&q->deq, &pos, head - q->cnt, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                __atomic_fetch_add(&q->dropped, head - q->cnt - pos, __ATOMIC_RELAXED);
+            continue;
+        }
+        seq = MPMC_SEQ(q, pos);
+        s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (s1 < MPMC_LOSSY_SEQ(pos, 0) || s1 == MPMC_LOSSY_SEQ(pos, MPMC_LOSSY_WRITING))
+        {
+            // element pos is not written yet
+            return 0;
+        }
+        if (s1 == MPMC_LOSSY_SEQ(pos, MPMC_LOSSY_DONE))
+        {
+            if (pBuf)
+                cpmem(pBuf, MPMC_DATA(seq), q->size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+            if (s2 == s1)
+            {
+                if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    return q->size;
+                continue;
+            }
+        }
+        // given up by its writer, or overwritten by a later lap before or while it was copied
+        if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+unsigned int mpmc_Push(MpmcQueue *q, const void *pData)
+{
+    volatile unsigned long long *seq;
+    unsigned long long pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    long long diff;
+
+    if (q->lossy)
+        return mpmc_push_overwrite(q, pData);
+    for (;;)
+    {
+        seq = MPMC_SEQ(q, pos);
+        diff = (long long)(__atomic_load_n(seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->enq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // slot still holds the element of the previous lap
+            return 0;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+        }
+    }
+    if (pData)
+        cpmem(MPMC_DATA(seq), pData, q->size);
+    __atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+    return q->size;
+}
+
+unsigned int mpmc_Pop(MpmcQueue *q, void *pBuf)
+{
+    volatile unsigned long long *seq;
+    unsigned long long pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    long long diff;
+
+    if (q->lossy)
+        return mpmc_pop_lossy(q, pBuf);
+    for (;;)
+    {
+        seq = MPMC_SEQ(q, pos);
+        diff = (long long)(__atomic_load_n(seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // slot is not written yet
+            return 0;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+        }
+    }
+    if (pBuf)
+        cpmem(pBuf, MPMC_DATA(seq), q->size);
+    __atomic_store_n(seq, pos + q->cnt, __ATOMIC_RELEASE);
+    return q->size;
+}
+
+// len is rounded down to whole elements
+unsigned int mpmc_InsBlock(MpmcQueue *q, const void *pData, unsigned int len)
+{
+    unsigned int ret = 0;
+    while (len - ret >= q->size && mpmc_Push(q, pData ? (const char *)pData + ret : NULL))
+        ret += q->size;
+    return ret;
+}
+
+unsigned int mpmc_ExtrBlock(MpmcQueue *q, void *pBuf, unsigned int len)
+{
+    unsigned int ret = 0;
+    while (len - ret >= q->size && mpmc_Pop(q, pBuf ? (char *)pBuf + ret : NULL))
+        ret += q->size;
+    return ret;
+}
+
+unsigned int mpmc_GetDataLen(const MpmcQueue *q)
+{
+    unsigned long long deq = __atomic_load_n(&q->deq, __ATOMIC_ACQUIRE);
+    unsigned long long enq = __atomic_load_n(&q->enq, __ATOMIC_ACQUIRE);
+    if (enq <= deq)
+        return 0;
+    if (enq - deq > q->cnt)
+        return q->cnt * q->size;
+    return (unsigned int)(enq - deq) * q->size;
+}
+
+void mpmc_InitQueue(MpmcQueue *q, void *buf, unsigned int cnt, unsigned int size)
+{
+    unsigned int i;
+    zmem(q, sizeof(*q));
+    q->cnt = cnt;
+    q->size = size;
+    q->slot = mpmc_BufSize(1, size);
+    q->buf = buf;
+    for (i = 0; i < cnt; i++)
+        *MPMC_SEQ(q, i) = i;
+}
+
+void mpmc_InitLossy(MpmcQueue *q, void *buf, unsigned int cnt, unsigned int size)
+{
+    unsigned int i;
+    mpmc_InitQueue(q, buf, cnt, size);
+    q->lossy = 1;
+    for (i = 0; i < cnt; i++)
+        *MPMC_SEQ(q, i) = 0;
+}
+
+unsigned long long mpmc_GetDropped(const MpmcQueue *q)
+{
+    return __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
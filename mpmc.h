@@ -0,0 +1,43 @@
+#ifndef _MPMC_H_
+#define _MPMC_H_
+
+#include "rtos.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define MPMC_CACHE_LINE 64
+
+// Multi producer / multi consumer queue of fixed size elements.
+// Every slot carries a sequence number telling whose turn it is, so
+// readers and writers never fail while the queue has data or space.
+// In lossy mode writers always succeed and overwrite the oldest element,
+// the sequence works as a per slot seqlock so readers never see a torn one.
+typedef struct
+{
+    volatile unsigned long long enq __attribute__((aligned(MPMC_CACHE_LINE)));
+    volatile unsigned long long deq __attribute__((aligned(MPMC_CACHE_LINE)));
+    volatile unsigned long long dropped;  // lossy mode: elements overwritten before they were read, counted by readers
+    unsigned int cnt __attribute__((aligned(MPMC_CACHE_LINE)));
+    unsigned int size;
+    unsigned int lossy;
+    unsigned int slot;  // sequence number + element, 8 byte aligned
+    unsigned char *buf;
+} MpmcQueue;
+
+unsigned int mpmc_BufSize(unsigned int cnt, unsigned int size);
+void mpmc_InitQueue(MpmcQueue *q, void *buf, unsigned int cnt, unsigned int size);
+void mpmc_InitLossy(MpmcQueue *q, void *buf, unsigned int cnt, unsigned int size);
+unsigned long long mpmc_GetDropped(const MpmcQueue *q);
+unsigned int mpmc_Push(MpmcQueue *q, const void *pData);
+unsigned int mpmc_Pop(MpmcQueue *q, void *pBuf);
+unsigned int mpmc_InsBlock(MpmcQueue *q, const void *pData, unsigned int len);
+unsigned int mpmc_ExtrBlock(MpmcQueue *q, void *pBuf, unsigned int len);
+unsigned int mpmc_GetDataLen(const MpmcQueue *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // _MPMC_H_
@@ -9,6 +9,9 @@
 #include <errno.h>
 
 #include "rtos.h"
+#include "trace.h"
+#include "green.h"
+#include "futex.h"
 
 static pthread_mutex_t mutex_printf = PTHREAD_MUTEX_INITIALIZER;
 
@@ -34,6 +37,16 @@ unsigned int os_get_usec_clock(void)
     return t;
 }
 
+// 64-bit monotonic clock, does not wrap
+unsigned long long os_get_nsec_clock(void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return (unsigned long long)tm.tv_sec * 1000000000ULL + tm.tv_nsec;
+}
+
+int os_log_write(const char *buf, int len);
 int os_printf(const char *fmt, ...)
 {
     int ret = 0, ret2;
@@ -42,15 +55,17 @@ int os_printf(const char *fmt, ...)
     int max_len = sizeof(buf);
     va_list arg;
 #if 1
-    double cur_time = os_get_msec_clock() / 1000.;
-    ret = snprintf(buf, max_len, "[S%.3f %s] ", cur_time, os_get_cur_task_name());
+    unsigned int cur_time = os_get_msec_clock();
+    ret = snprintf(buf, max_len, "[S%u.%03u %s] ", cur_time / 1000, cur_time % 1000, os_get_cur_task_name());
     ps = buf + ret;
     max_len -= ret;
 #endif
     va_start(arg, fmt);
     ret2 = vsnprintf(ps, max_len, fmt, arg);
     va_end(arg);
-    if (ret2 > 0)
+    if (ret2 >= max_len)
+        ret2 = max_len - 1;
+    if (ret2 > 0 && !os_log_write(buf, ret + ret2))
     {
         pthread_mutex_lock(&mutex_printf);
         write(2, buf, ret + ret2);
@@ -67,54 +82,124 @@ int os_terminate(const char *fmt, ...)
     va_start(arg, fmt);
     len = vsnprintf(buf, sizeof(buf) - 1, fmt, arg);
     va_end(arg);
+    os_log_flush();
     write(2, buf, len);
     exit(-1);
 }
 
+int MutexAddPI(MUTEX_ID *m)
+{
+    pthread_mutexattr_t attr;
+    int ret = 1;
+
+    pthread_mutexattr_init(&attr);
+    if (pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT) || pthread_mutex_init(m, &attr))
+    {
+        pthread_mutex_init(m, 0);
+        ret = 0;
+    }
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+// spin bound on SMP, a single CPU never spins since the holder cannot run meanwhile
+#define SEM_SPIN_MAX 200
+
+static int sem_spin_max = -1;
+
+static inline void sem_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 void SemaphoreInit(SEM_ID *sem)
 {
-    sem_init(sem, 0, 1);
+    sem->cnt = 1;
+    sem->waiters = 0;
+    sem->spin = 0;
+    if (sem_spin_max < 0)
+        sem_spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SEM_SPIN_MAX : 0;
 }
 
-int SemaphoreLock(SEM_ID *sem, int timeout_ms)
+int SemaphoreTryLock(SEM_ID *sem)
 {
-    if (timeout_ms <= 0)
+    unsigned int c = __atomic_load_n(&sem->cnt, __ATOMIC_RELAXED);
+    while (c)
     {
-        return sem_wait(sem);
+        if (__atomic_compare_exchange_n(&sem->cnt, &c, c - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
     }
-    else
+    return 0;
+}
+
+static int semaphore_lock(SEM_ID *sem, int timeout_ms)
+{
+    unsigned long long deadline = timeout_ms > 0 ? os_get_nsec_clock() + timeout_ms * 1000000ULL : 0;
+    int ok = timeout_ms > 0 ? 1 : 0;
+    int limit = sem->spin * 2 + 10;
+    int i;
+
+    if (SemaphoreTryLock(sem))
+        return ok;
+    if (limit > sem_spin_max)
+        limit = sem_spin_max;
+    for (i = 0; i < limit; i++)
     {
-        int ret;
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_nsec += timeout_ms * 1000000;
-        while (ts.tv_nsec > 1000000000)
+        sem_relax();
+        if (__atomic_load_n(&sem->cnt, __ATOMIC_RELAXED) && SemaphoreTryLock(sem))
         {
-            ts.tv_nsec -= 1000000000;
-            ts.tv_sec++;
-        }
-        while ((ret = sem_timedwait(sem, &ts)) == -1 && errno == EINTR)
-            continue; /* Restart if interrupted by handler */
-        if (ret == -1)
-        {
-            if (errno != ETIMEDOUT)
-                return -1;
-        }
-        else
-        {
-            return 1;
+            sem->spin += (i - sem->spin) / 8;
+            return ok;
         }
-        return 0;  // timeout
+    }
+    if (limit)
+        sem->spin -= sem->spin / 8 + 1;  // spinning did not pay, shorten it
+    if (sem->spin < 0)
+        sem->spin = 0;
+    for (;;)
+    {
+        if (SemaphoreTryLock(sem))
+            return ok;
+        if (deadline && os_get_nsec_clock() >= deadline)
+            return 0;
+        // count in before the last look at cnt, a post either is seen here or sees the waiter
+        __atomic_fetch_add(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&sem->cnt, __ATOMIC_SEQ_CST) == 0)
+            futex_wait(&sem->cnt, 0, deadline, FUTEX_BITSET_MATCH_ANY);
+        __atomic_fetch_sub(&sem->waiters, 1, __ATOMIC_RELAXED);
     }
 }
 
+int SemaphoreLock(SEM_ID *sem, int timeout_ms)
+{
+    int ret;
+    OS_TRACE(TRACE_SEM_WAIT, -1, sem, timeout_ms);
+    // green tasks give the worker to another task instead of blocking it
+    ret = green_active() ? green_sem_lock(sem, timeout_ms) : semaphore_lock(sem, timeout_ms);
+    OS_TRACE(TRACE_SEM_WAKE, -1, sem, ret);
+    return ret;
+}
+
 void SemaphoreUnlock(SEM_ID *sem)
 {
-    sem_post(sem);
+    OS_TRACE(TRACE_SEM_POST, -1, sem, 0);
+    __atomic_fetch_add(&sem->cnt, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST))
+        futex_wake(&sem->cnt, 1, FUTEX_BITSET_MATCH_ANY);
+    green_sem_wake(sem);
 }
 
 void os_sleep_ms(int ms)
 {
+    if (green_active())
+    {
+        green_sleep_ms(ms);
+        return;
+    }
     usleep(ms * 1000);
 }
 
@@ -22,11 +22,20 @@ void os_start(void);
 
 int os_printf(const char *fmt, ...);
 int os_terminate(const char *fmt, ...);
+// os_printf queues lines for a logger thread, full queues drop lines instead of blocking
+int os_log_start(int ring_size);
+void os_log_flush(void);
+unsigned long long os_log_get_dropped(void);
+
+/* Trace, per-thread event rings dumped as Chrome trace JSON */
+void os_trace_enable(int on);
+int os_trace_dump(const char *path);
 
 void os_sleep_ms(int);
 
 unsigned int os_get_msec_clock(void);
 unsigned int os_get_usec_clock(void);
+unsigned long long os_get_nsec_clock(void);
 
 /* Task */
 struct os_task
@@ -38,29 +47,151 @@ struct os_task
     void *data;
 };
 
+enum OS_SCHED_POLICY
+{
+    OS_SCHED_OTHER,
+    OS_SCHED_FIFO,
+    OS_SCHED_RR
+};
+
+typedef struct
+{
+    int policy;  // OS_SCHED_*, real-time policies fall back to OS_SCHED_OTHER without privileges
+    int priority;  // 0 is the highest
+    unsigned long long affinity;  // bit n allows CPU n, 0 allows all
+    int stack_size;  // 0 for the default
+    int mlock;  // lock the process memory, page faults stall real-time tasks
+    int thread;  // run on its own thread even after os_green_init
+} OS_TASK_ATTR;
+
 int os_create_task(const char *name, void (*entry_func)(void *), int prio, void *data);
+// attr NULL selects the defaults, an OS_SCHED_OTHER task of priority 0
+int os_create_task_ex(const char *name, void (*entry_func)(void *), const OS_TASK_ATTR *attr, void *data);
+// Run the following OS_SCHED_OTHER tasks as coroutines on worker threads,
+// SemaphoreLock, io_read and os_sleep_ms then switch tasks instead of blocking.
+// Such tasks run on any worker, os_create_task_ex fails for them if attr->affinity is set.
+int os_green_init(int workers, int stack_size);
+void os_task_yield(void);
 const char *os_get_cur_task_name(void);
 
+/* Periodic tasks, released on absolute CLOCK_MONOTONIC deadlines so execution time does not drift the period */
+typedef struct os_period OS_PERIOD;
+
+// times in ns
+typedef struct
+{
+    unsigned long long releases;
+    unsigned long long overruns;  // releases skipped because a cycle ran past them
+    unsigned long long jitter_mean;  // wake-up delay after the release time
+    unsigned long long jitter_max;
+    unsigned long long jitter_p99;
+    unsigned long long jitter_p999;
+    unsigned long long exec_mean;  // from the wake-up to the next os_period_wait
+    unsigned long long exec_max;
+    unsigned long long exec_p99;
+    unsigned long long exec_p999;
+} OS_PERIOD_STATS;
+
+// the first release is one period from now
+OS_PERIOD *os_period_create(int period_us);
+// Sleeps until the next release, returns the number of releases missed since the last call
+int os_period_wait(OS_PERIOD *p);
+void os_period_get_stats(OS_PERIOD *p, OS_PERIOD_STATS *st);
+void os_period_delete(OS_PERIOD *p);
+
 /* Mutex */
 #define SYS_PMUTEX void *;
 #define MUTEX_ID pthread_mutex_t
 #define MutexLock pthread_mutex_lock
 #define MutexUnlock pthread_mutex_unlock
 #define MutexAdd(m) pthread_mutex_init((m), 0)
+// priority inheritance mutex, returns 0 if only a plain one could be made
+int MutexAddPI(MUTEX_ID *m);
+
+/* Semahore, futex based, posts make no syscall while nobody sleeps */
+typedef struct
+{
+    volatile unsigned int cnt;  // futex word
+    volatile int waiters;  // threads sleeping or about to
+    volatile int spin;  // adaptive spin length, the average of the spins that got the semaphore
+} OS_SEM;
 
-/* Semahore */
-#define SEM_ID sem_t
+#define SEM_ID OS_SEM
 void SemaphoreInit(SEM_ID *sem);
+// timeout_ms > 0 returns 1 when taken and 0 on timeout, otherwise waits forever and returns 0
 int SemaphoreLock(SEM_ID *sem, int timeout_ms);
+// returns 1 if taken without waiting
+int SemaphoreTryLock(SEM_ID *sem);
 void SemaphoreUnlock(SEM_ID *sem);
 
+/* Event groups, a word of flags tasks wait on for any or all of a set of bits */
+typedef struct
+{
+    volatile unsigned long long flags;
+    volatile unsigned int seq;  // futex word, bumped by sets that find waiters
+    volatile int waiters;
+} OS_EVENT;
+
+enum OS_EVENT_MODE
+{
+    OS_EVENT_ANY = 0,  // wake when one of the bits is set
+    OS_EVENT_ALL = 1,  // wake when every bit is set
+    OS_EVENT_CLEAR = 2  // clear the waited bits on wake-up
+};
+
+void os_event_init(OS_EVENT *ev);
+// return the flags before the change
+unsigned long long os_event_set(OS_EVENT *ev, unsigned long long bits);
+unsigned long long os_event_clear(OS_EVENT *ev, unsigned long long bits);
+unsigned long long os_event_get(OS_EVENT *ev);
+// timeout_ms <= 0 waits forever, returns IO_OK or IO_TIMEOUT, *res gets the flags seen (before the clear)
+int os_event_wait(OS_EVENT *ev, unsigned long long bits, int mode, int timeout_ms, unsigned long long *res);
+
+/* Jobs, run by a pool of worker threads stealing from each other */
+typedef struct
+{
+    volatile unsigned int cnt;  // jobs not finished yet, futex word
+} OS_WAITGROUP;
+
+typedef struct
+{
+    unsigned long long jobs;  // jobs run
+    unsigned long long steals;  // jobs taken from another worker
+    unsigned long long steal_fails;  // rounds that found no job anywhere
+    unsigned long long idles;  // times the worker went to sleep
+} OS_JOB_STATS;
+
+// workers are tasks, they run jobs once os_start has been called
+int os_job_init(int workers);
+int os_job_submit(void (*fn)(void *), void *arg, OS_WAITGROUP *wg);
+void os_wg_init(OS_WAITGROUP *wg);
+void os_wg_wait(OS_WAITGROUP *wg);
+int os_job_get_stats(int worker, OS_JOB_STATS *st);
+
+/* Timers, serviced by one thread with a hierarchical timing wheel */
+typedef struct os_timer OS_TIMER;
+OS_TIMER *os_timer_create(void (*func)(void *), void *arg);
+OS_TIMER *os_timer_create_io(short id, const void *msg, int len);
+int os_timer_start(OS_TIMER *t, int delay_ms, int period_ms);
+int os_timer_stop(OS_TIMER *t);
+void os_timer_delete(OS_TIMER *t);
+
 /* IO */
+// Region of a stream buffer, split in two parts when it wraps the ring end
+typedef struct
+{
+    void *ptr[2];
+    unsigned int len[2];
+    unsigned long long pos;  // stream position of the region
+} IO_SPAN;
+
 typedef enum
 {
     IO_OK = 1,
     IO_ERR = -1,
     IO_TIMEOUT = -2,
-    IO_UNDEF = -3
+    IO_UNDEF = -3,
+    IO_MSGSIZE = -4  // buffer too small for the record, see IO_CMD_GET_MSG_SIZE
 } IO_RET;
 
 typedef enum
@@ -71,8 +202,15 @@ typedef enum
     O_NOCOPY = 0x40,
     O_NONBLOCK = 0x80,
     O_READ_BLOCK = 0,  // must be zero
-    O_BOX = 0x100,
-    O_OVERWRITE = 0x200  // Overwrite element if pipe is full
+    O_BOX = 0x100,        // Latest value, readers get the newest element, writers never fail
+    O_OVERWRITE = 0x200,  // Overwrite element if pipe is full
+    O_MIRROR = 0x400,     // Double mapped buffer, elements never split at the end
+    O_SPSC = 0x800,       // Single writer and single reader stream
+    O_MPMC = 0x1000,      // Queue of size byte elements for any number of readers and writers
+    O_POW2 = 0x2000,      // Round the buffer size up to a power of two
+    O_WRITE_BLOCK = 0x4000,  // Writers wait for free space instead of dropping data
+    O_FRAMED = 0x8000,  // Every write is one record, every read returns one whole record
+    O_TIMESTAMP = 0x10000  // Stamp messages on write, read latency in IO_CMD_GET_LATENCY
 } IO_MODE_FLAGS;
 
 enum IO_CMD
@@ -81,16 +219,77 @@ enum IO_CMD
     IO_CMD_GET_ELEMSIZE,
     IO_CMD_SET_HANDLER,
     IO_CMD_GET_FREE_SIZE,
-    IO_CMD_RESET
+    IO_CMD_RESET,
+    IO_CMD_GET_DROP_COUNT,  // O_OVERWRITE elements discarded unread, unsigned long long
+    IO_CMD_GET_MSG_SIZE,  // length of the next O_FRAMED record, 0 if none
+    IO_CMD_GET_STATS,  // IO_STATS *, IO_CMD_RESET clears them
+    IO_CMD_GET_LATENCY  // IO_LATENCY *, O_TIMESTAMP streams only
+};
+
+typedef struct
+{
+    unsigned long long msgs_in;
+    unsigned long long bytes_in;
+    unsigned long long msgs_out;
+    unsigned long long bytes_out;
+    unsigned long long drops;  // writes rejected for lack of space and O_OVERWRITE losses
+    unsigned long long high_water;  // most bytes queued, sampled
+    unsigned long long rd_block_us;  // time readers spent waiting for data
+    unsigned long long wr_block_us;  // time O_WRITE_BLOCK writers spent waiting for space
+    unsigned long long rd_contention;  // reads that found another reader in progress
+} IO_STATS;
+
+// write to read delay of the messages of a stream in ns
+typedef struct
+{
+    unsigned long long cnt;
+    unsigned long long mean;
+    unsigned long long max;
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long p999;
+} IO_LATENCY;
+
+enum IO_EVENTS
+{
+    IO_EV_READ = 1,  // an element can be read
+    IO_EV_WRITE = 2,  // an element can be written
+    IO_EV_EDGE = 0x100  // report state changes only, default is level triggered
 };
 
+typedef struct
+{
+    short id;
+    unsigned short events;
+} IO_EVENT;
+
 int io_ioctl(short id, int cmd, ...);
 int io_init(void *buf, int len);
 int io_open(short id, int cnt, int size, unsigned int mode);
 int io_read(short id, void *buf, int len);
+// timeout_ms <= 0 waits forever, returns IO_TIMEOUT if nothing was transferred in time
+int io_read_timeout(short id, void *buf, int len, int timeout_ms);
+int io_read_peek(short id, int len, IO_SPAN *span);
+int io_read_release(short id, const IO_SPAN *span, int len);
 int io_write(short id, const void *buf, int len);
+int io_write_timeout(short id, const void *buf, int len, int timeout_ms);
+int io_readv(short id, void **buf, const unsigned int *len, int cnt);
+int io_readv_timeout(short id, void **buf, const unsigned int *len, int cnt, int timeout_ms);
+int io_writev(short id, const void **buf, const unsigned int *len, int cnt);
+int io_writev_timeout(short id, const void **buf, const unsigned int *len, int cnt, int timeout_ms);
+// O_WRITE_BLOCK writers fail with IO_ERR (IO_MSGSIZE if O_FRAMED) when len exceeds the ring,
+// is not a whole number of O_MPMC elements or is not the O_BOX size,
+// io_write_reserve waits for space without a timeout
+int io_write_reserve(short id, int len, IO_SPAN *span);
+int io_write_commit(short id, const IO_SPAN *span);
 int io_select(int rds_count, short rds_arr[], short *rds_res, int timeout);
 
+/* IO event sets, a stream can be in one set at a time */
+int io_evset_create(void);
+int io_evset_add(int set, short id, unsigned int events);
+int io_evset_del(int set, short id);
+int io_evset_wait(int set, IO_EVENT *ev, int max, int timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,177 @@
+#include <string.h>
+#include <stddef.h>
+
+#include "spsc.h"
+#include "fifo.h"
+
+#define cpmem memcpy
+#define zmem(p, sz) memset((p), 0, (sz))
+
+static __inline unsigned int spsc_used(const SpscFifo *fifo, unsigned int wr, unsigned int rd)
+{
+    return wr >= rd ? wr - rd : wr + 2 * fifo->limit - rd;
+}
+
+// idx + len reaches 3 * limit, which wraps 32 bits for rings above 0x55555555 bytes
+static __inline unsigned int spsc_advance(const SpscFifo *fifo, unsigned int idx, unsigned int len)
+{
+    unsigned long long next = (unsigned long long)idx + len;
+    if (next >= 2ULL * fifo->limit)
+        next -= 2ULL * fifo->limit;
+    return (unsigned int)next;
+}
+
+static __inline void spsc_make_span(const SpscFifo *fifo, unsigned int idx, unsigned int len, IO_SPAN *span)
+{
+    if (idx >= fifo->limit)
+        idx -= fifo->limit;
+    span->ptr[0] = fifo->buf + idx;
+    span->ptr[1] = fifo->buf;
+    if (!fifo->mirror && idx + len > fifo->limit)
+        span->len[1] = idx + len - fifo->limit;
+    else
+        span->len[1] = 0;
+    span->len[0] = len - span->len[1];
+}
+
+unsigned int spsc_GetDataLen(const SpscFifo *fifo)
+{
+    unsigned int rd = __atomic_load_n(&fifo->rdIdx, __ATOMIC_ACQUIRE);
+    return spsc_used(fifo, __atomic_load_n(&fifo->wrIdx, __ATOMIC_ACQUIRE), rd);
+}
+
+unsigned int spsc_GetFreeLen(const SpscFifo *fifo)
+{
+    return fifo->limit - spsc_GetDataLen(fifo);
+}
+
+unsigned int spsc_WriteReserve(SpscFifo *fifo, unsigned int len, IO_SPAN *span)
+{
+    unsigned int wr = __atomic_load_n(&fifo->wrIdx, __ATOMIC_RELAXED);
+
+    if (len > fifo->limit - spsc_used(fifo, wr, fifo->rd_cache))
+    {
+        fifo->rd_cache = __atomic_load_n(&fifo->rdIdx, __ATOMIC_ACQUIRE);
+        if (len > fifo->limit - spsc_used(fifo, wr, fifo->rd_cache))
+            return 0;
+    }
+    spsc_make_span(fifo, wr, len, span);
+    return len;
+}
+
+void spsc_WriteCommit(SpscFifo *fifo, const IO_SPAN *span)
+{
+    unsigned int wr = __atomic_load_n(&fifo->wrIdx, __ATOMIC_RELAXED);
+    __atomic_store_n(&fifo->wrIdx, spsc_advance(fifo, wr, span->len[0] + span->len[1]), __ATOMIC_RELEASE);
+}
+
+unsigned int spsc_ReadPeek(SpscFifo *fifo, unsigned int len, IO_SPAN *span)
+{
+    unsigned int rd = __atomic_load_n(&fifo->rdIdx, __ATOMIC_RELAXED);
+    unsigned int size = spsc_used(fifo, fifo->wr_cache, rd);
+
+    if (len > size)
+    {
+        fifo->wr_cache = __atomic_load_n(&fifo->wrIdx, __ATOMIC_ACQUIRE);
+        size = spsc_used(fifo, fifo->wr_cache, rd);
+        if (len > size)
+            len = size;
+    }
+    if (len == 0)
+        return 0;
+    spsc_make_span(fifo, rd, len, span);
+    return len;
+}
+
+void spsc_ReadRelease(SpscFifo *fifo, const IO_SPAN *span, unsigned int len)
+{
+    unsigned int rd = __atomic_load_n(&fifo->rdIdx, __ATOMIC_RELAXED);
+    if (len > span->len[0] + span->len[1])
+        len = span->len[0] + span->len[1];
+    __atomic_store_n(&fifo->rdIdx, spsc_advance(fifo, rd, len), __ATOMIC_RELEASE);
+}
+
+unsigned int spsc_InsBlock(SpscFifo *fifo, const void *pData, unsigned int len)
+{
+    IO_SPAN span;
+
+    if (len == 0 || !spsc_WriteReserve(fifo, len, &span))
+        return 0;
+    if (pData)
+    {
+        cpmem(span.ptr[0], pData, span.len[0]);
+        if (span.len[1])
+            cpmem(span.ptr[1], (const char *)pData + span.len[0], span.len[1]);
+    }
+    spsc_WriteCommit(fifo, &span);
+    return len;
+}
+
+unsigned int spsc_ExtrBlock(SpscFifo *fifo, void *pBuf, unsigned int len)
+{
+    IO_SPAN span;
+
+    len = spsc_ReadPeek(fifo, len, &span);
+    if (len == 0)
+        return 0;
+    if (pBuf)
+    {
+        cpmem(pBuf, span.ptr[0], span.len[0]);
+        if (span.len[1])
+            cpmem((char *)pBuf + span.len[0], span.ptr[1], span.len[1]);
+    }
+    spsc_ReadRelease(fifo, &span, len);
+    return len;
+}
+
+unsigned int spsc_InsBlocks(SpscFifo *fifo, const void **pData, const unsigned int *plen, int cnt)
+{
+    int i;
+    IO_SPAN span;
+    unsigned int off = 0;
+    unsigned int len = 0;
+    for (i = 0; i < cnt; i++)
+    {
+        len += plen[i];
+    }
+    if (len == 0 || !spsc_WriteReserve(fifo, len, &span))
+        return 0;
+    for (i = 0; i < cnt; i++)
+    {
+        if (pData[i])
+            fifo_SpanWrite(&span, off, pData[i], plen[i]);
+        off += plen[i];
+    }
+    spsc_WriteCommit(fifo, &span);
+    return len;
+}
+
+unsigned int spsc_ExtrBlocks(SpscFifo *fifo, void **pBuf, const unsigned int *plen, int cnt)
+{
+    int i;
+    IO_SPAN span;
+    unsigned int off = 0;
+    unsigned int len = 0;
+    for (i = 0; i < cnt; i++)
+    {
+        len += plen[i];
+    }
+    len = spsc_ReadPeek(fifo, len, &span);
+    if (len == 0)
+        return 0;
+    for (i = 0; i < cnt && off + plen[i] <= len; i++)
+    {
+        if (pBuf[i])
+            fifo_SpanRead(&span, off, pBuf[i], plen[i]);
+        off += plen[i];
+    }
+    spsc_ReadRelease(fifo, &span, off);
+    return off;
+}
+
+void spsc_InitFifo(SpscFifo *fifo, void *buf, unsigned int size)
+{
+    zmem(fifo, sizeof(*fifo));
+    fifo->limit = size;
+    fifo->buf = buf;
+}
@@ -0,0 +1,44 @@
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include "rtos.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SPSC_CACHE_LINE 64
+
+// Single producer / single consumer ring.
+// Indices run over [0, 2 * limit) so a full ring differs from an empty one.
+typedef struct
+{
+    // producer line
+    volatile unsigned int wrIdx __attribute__((aligned(SPSC_CACHE_LINE)));
+    unsigned int rd_cache;  // last seen rdIdx
+    // consumer line
+    volatile unsigned int rdIdx __attribute__((aligned(SPSC_CACHE_LINE)));
+    unsigned int wr_cache;  // last seen wrIdx
+    // read only
+    unsigned int limit __attribute__((aligned(SPSC_CACHE_LINE)));
+    unsigned char mirror;
+    unsigned char *buf;
+} SpscFifo;
+
+void spsc_InitFifo(SpscFifo *fifo, void *buf, unsigned int size);
+unsigned int spsc_GetDataLen(const SpscFifo *fifo);
+unsigned int spsc_GetFreeLen(const SpscFifo *fifo);
+unsigned int spsc_InsBlock(SpscFifo *fifo, const void *pData, unsigned int len);
+unsigned int spsc_ExtrBlock(SpscFifo *fifo, void *pBuf, unsigned int len);
+unsigned int spsc_InsBlocks(SpscFifo *fifo, const void **pData, const unsigned int *plen, int cnt);
+unsigned int spsc_ExtrBlocks(SpscFifo *fifo, void **pBuf, const unsigned int *plen, int cnt);
+unsigned int spsc_WriteReserve(SpscFifo *fifo, unsigned int len, IO_SPAN *span);
+void spsc_WriteCommit(SpscFifo *fifo, const IO_SPAN *span);
+unsigned int spsc_ReadPeek(SpscFifo *fifo, unsigned int len, IO_SPAN *span);
+void spsc_ReadRelease(SpscFifo *fifo, const IO_SPAN *span, unsigned int len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // _SPSC_H_
@@ -2,6 +2,7 @@
  * task.c
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -13,8 +14,14 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <time.h>
 
 #include "rtos.h"
+#include "trace.h"
+#include "green.h"
+#include "hist.h"
 
 #define STACK_LEN 1000000
 #define MAX_THREAD_NUM 100
@@ -31,6 +38,11 @@ struct os_task *os_get_cur_task(void)
     return cur_task_ptr;
 }
 
+void os_set_cur_task(struct os_task *task)
+{
+    cur_task_ptr = task;
+}
+
 const char *os_get_cur_task_name(void)
 {
     if (cur_task_ptr)
@@ -49,69 +61,151 @@ static void *start_thread_context(void *p)
         cur_task_ptr->entry_func = ppar->entry_func;
         cur_task_ptr->data = ppar->data;
         memcpy(cur_task_ptr->name, ppar->name, sizeof(cur_task_ptr->name));
+        prctl(PR_SET_NAME, cur_task_ptr->name, 0, 0, 0);
         sem_init(&cur_task_ptr->sem, 0, 1);
         if (cur_task_ptr->entry_func)
         {
             sem_post(&sem_create);
             sem_wait(&sem_start);
             sem_post(&sem_start);
-            os_printf("start thread #%s %p %x\n", cur_task_ptr->name, cur_task_ptr->entry_func,
-                      (unsigned int)cur_task_ptr->data);
+            os_printf("start thread #%s %p %p\n", cur_task_ptr->name, cur_task_ptr->entry_func, cur_task_ptr->data);
+            OS_TRACE(TRACE_TASK_START, -1, cur_task_ptr->entry_func, cur_task_ptr->priority);
             cur_task_ptr->entry_func(cur_task_ptr->data);
+            OS_TRACE(TRACE_TASK_STOP, -1, cur_task_ptr->entry_func, 0);
             os_printf("stop thread #%s\n", cur_task_ptr->name);
         }
     }
     return 0;
 }
 
-int os_create_task(const char *name, void (*entry_func)(void *), int priority, void *data)
+// Fill in the pthread attributes, returns 0 or the failing call's error
+static int task_set_attr(pthread_attr_t *tattr, const OS_TASK_ATTR *attr, int policy, const char *name)
 {
     int res;
-    unsigned int sh_policy;
-    struct os_task par;
     struct sched_param param;
-    int max_task_prior;
-    pthread_t thread;
-    pthread_t *pthread = &thread;
-
-    pthread_attr_t tattr;
-
-    os_printf("os_create_task %s %p %x\n", name, entry_func, (unsigned int)data);
-    pthread_attr_init(&tattr);
+    size_t stack = attr->stack_size > 0 ? (size_t)attr->stack_size : STACK_LEN;
 
-    pthread_attr_setstacksize(&tattr, STACK_LEN);
-    pthread_attr_getschedparam(&tattr, &param);
+    if (stack < (size_t)PTHREAD_STACK_MIN)
+        stack = PTHREAD_STACK_MIN;
+    pthread_attr_setstacksize(tattr, stack);
+    pthread_attr_getschedparam(tattr, &param);
 
-    sh_policy = SCHED_OTHER;
-
-    res = pthread_attr_setschedpolicy(&tattr, sh_policy);
+    res = pthread_attr_setschedpolicy(tattr, policy);
     if (res)
     {
         os_printf("pthread_attr_setschedpolicy err %s,ret:%d\n", name, res);
-        return -1;
+        return res;
     }
-    max_task_prior = sched_get_priority_max(sh_policy);
-
-    param.sched_priority = (max_task_prior - priority);
-
-    if (sh_policy == SCHED_OTHER)
+    if (policy == SCHED_OTHER)
     {
         param.sched_priority = 0;
     }
-    res = pthread_attr_setschedparam(&tattr, &param);
+    else
+    {
+        // priority 0 is the highest
+        param.sched_priority = sched_get_priority_max(policy) - attr->priority;
+        if (param.sched_priority < sched_get_priority_min(policy))
+            param.sched_priority = sched_get_priority_min(policy);
+        pthread_attr_setinheritsched(tattr, PTHREAD_EXPLICIT_SCHED);
+    }
+    res = pthread_attr_setschedparam(tattr, &param);
     if (res)
     {
         os_printf("pthread_attr_setschedparam err %s,ret:%d\n", name, res);
+        return res;
+    }
+    if (attr->affinity)
+    {
+        cpu_set_t cpus;
+        int i;
+        CPU_ZERO(&cpus);
+        for (i = 0; i < 64 && i < CPU_SETSIZE; i++)
+        {
+            if (attr->affinity & (1ULL << i))
+                CPU_SET(i, &cpus);
+        }
+        res = pthread_attr_setaffinity_np(tattr, sizeof(cpus), &cpus);
+        if (res)
+        {
+            os_printf("pthread_attr_setaffinity_np err %s,ret:%d\n", name, res);
+            return res;
+        }
+    }
+    return 0;
+}
+
+int os_create_task_ex(const char *name, void (*entry_func)(void *), const OS_TASK_ATTR *attr, void *data)
+{
+    int res;
+    int policy;
+    struct os_task par;
+    pthread_t thread;
+    pthread_t *pthread = &thread;
+    OS_TASK_ATTR def;
+
+    pthread_attr_t tattr;
+
+    os_printf("os_create_task %s %p %p\n", name, entry_func, data);
+    if (attr == NULL)
+    {
+        memset(&def, 0, sizeof(def));
+        attr = &def;
+    }
+    if (attr->mlock && mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+        os_printf("mlockall err %s %s\n", name, strerror(errno));
+    }
+    if (green_enabled() && attr->policy == OS_SCHED_OTHER && !attr->thread)
+    {
+        // green tasks move between the workers
+        if (attr->affinity)
+        {
+            os_printf("os_create_task %s: affinity needs attr->thread\n", name);
+            return -1;
+        }
+        return green_create(name, entry_func, attr->priority, data, attr->stack_size);
+    }
+
+    switch (attr->policy)
+    {
+        case OS_SCHED_FIFO:
+            policy = SCHED_FIFO;
+            break;
+        case OS_SCHED_RR:
+            policy = SCHED_RR;
+            break;
+        default:
+            policy = SCHED_OTHER;
+            break;
+    }
+    if (thread_num >= MAX_THREAD_NUM - 1)
+    {
+        // start_thread_context would not report back
+        os_printf("os_create_task %s: too many tasks\n", name);
         return -1;
     }
-    prctl(PR_SET_NAME, name, 0, 0, 0);
+
     par.entry_func = entry_func;
     strncpy(par.name, name, sizeof(par.name) - 1);
     par.name[sizeof(par.name) - 1] = 0;
-    par.priority = priority;
+    par.priority = attr->priority;
     par.data = data;
 
-    res = pthread_create(pthread, &tattr, start_thread_context, (void *)&par);
+    pthread_attr_init(&tattr);
+    res = task_set_attr(&tattr, attr, policy, name);
+    if (res == 0)
+        res = pthread_create(pthread, &tattr, start_thread_context, (void *)&par);
+    if (res == EPERM && policy != SCHED_OTHER)
+    {
+        // no real-time privileges, run as a normal task
+        os_printf("no RT privileges for %s, using SCHED_OTHER\n", name);
+        pthread_attr_destroy(&tattr);
+        pthread_attr_init(&tattr);
+        res = task_set_attr(&tattr, attr, SCHED_OTHER, name);
+        if (res == 0)
+            res = pthread_create(pthread, &tattr, start_thread_context, (void *)&par);
+    }
+    pthread_attr_destroy(&tattr);
     if (res)
     {
         os_printf("pthread_create err %s,ret:%d\n", name, res);
@@ -123,19 +217,98 @@ int os_create_task(const char *name, void (*entry_func)(void *), int priority, v
         os_printf("pthread_detach err %s,ret:%d\n", name, res);
         return -1;
     }
-    if (sh_policy != SCHED_OTHER)
-    {
-        res = pthread_setschedparam(*pthread, sh_policy, &param);
-        if (res != 0)
-        {
-            os_printf("pthread_setschedparam err %s\n", strerror(errno));
-            return -1;
-        }
-    }
     sem_wait(&sem_create);
     return 0;
 }
 
+int os_create_task(const char *name, void (*entry_func)(void *), int priority, void *data)
+{
+    OS_TASK_ATTR attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.policy = OS_SCHED_OTHER;
+    attr.priority = priority;
+    return os_create_task_ex(name, entry_func, &attr, data);
+}
+
+struct os_period
+{
+    unsigned long long period;  // ns
+    unsigned long long release;  // current release time
+    unsigned long long wake;  // when the task woke for it
+    unsigned long long releases;
+    unsigned long long overruns;
+    Hist jitter;
+    Hist exec;
+};
+
+OS_PERIOD *os_period_create(int period_us)
+{
+    OS_PERIOD *p;
+    if (period_us <= 0 || (p = malloc(sizeof(*p))) == NULL)
+        return NULL;
+    memset(p, 0, sizeof(*p));
+    hist_Init(&p->jitter);
+    hist_Init(&p->exec);
+    p->period = (unsigned long long)period_us * 1000;
+    p->release = p->wake = os_get_nsec_clock();
+    return p;
+}
+
+int os_period_wait(OS_PERIOD *p)
+{
+    unsigned long long now = os_get_nsec_clock();
+    unsigned long long next = p->release + p->period;
+    struct timespec ts;
+    int missed = 0;
+
+    if (p->releases)
+        hist_Record(&p->exec, now - p->wake);
+    if (now > next)
+    {
+        // late, skip to the next release still ahead instead of running the missed ones back to back
+        missed = (int)((now - next) / p->period) + 1;
+        next += (unsigned long long)missed * p->period;
+        p->overruns += missed;
+        OS_TRACE(TRACE_TASK_OVERRUN, -1, p, missed);
+    }
+    if (green_active())
+    {
+        green_sleep_until(next);
+    }
+    else
+    {
+        ts.tv_sec = next / 1000000000ULL;
+        ts.tv_nsec = next % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    p->wake = os_get_nsec_clock();
+    p->release = next;
+    p->releases++;
+    hist_Record(&p->jitter, p->wake > next ? p->wake - next : 0);
+    return missed;
+}
+
+void os_period_get_stats(OS_PERIOD *p, OS_PERIOD_STATS *st)
+{
+    st->releases = p->releases;
+    st->overruns = p->overruns;
+    st->jitter_mean = hist_GetMean(&p->jitter);
+    st->jitter_max = hist_GetMax(&p->jitter);
+    st->jitter_p99 = hist_Percentile(&p->jitter, 0.99);
+    st->jitter_p999 = hist_Percentile(&p->jitter, 0.999);
+    st->exec_mean = hist_GetMean(&p->exec);
+    st->exec_max = hist_GetMax(&p->exec);
+    st->exec_p99 = hist_Percentile(&p->exec, 0.99);
+    st->exec_p999 = hist_Percentile(&p->exec, 0.999);
+}
+
+void os_period_delete(OS_PERIOD *p)
+{
+    free(p);
+}
+
 void os_init_task(void)
 {
     thread_num = 0;
@@ -148,4 +321,6 @@ void os_start(void)
 {
     os_printf("os_start %d\n", thread_num);
     sem_post(&sem_start);
+    if (green_enabled())
+        green_start();
 }
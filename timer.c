@@ -0,0 +1,318 @@
+/*
+ * timer.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rtos.h"
+
+// Four wheels of 256 slots with a 1 ms tick, a timer sits in the wheel matching
+// how far away it is and moves down a wheel each time the one below wraps
+#define TMR_BITS 8
+#define TMR_SLOTS (1 << TMR_BITS)
+#define TMR_MASK (TMR_SLOTS - 1)
+#define TMR_LEVELS 4
+#define TMR_MAX_DELAY 0xffffffffULL
+
+typedef struct tmr_link
+{
+    struct tmr_link *next;
+    struct tmr_link *prev;
+} TMR_LINK;
+
+struct os_timer
+{
+    TMR_LINK link;  // slot list while armed
+    unsigned long long expires;  // tick
+    unsigned int period;  // ms, 0 for a one-shot timer
+    void (*func)(void *);
+    void *arg;
+    short id;  // stream for message delivery
+    int len;
+    void *msg;
+    unsigned char armed;
+    unsigned char deleted;  // freed once the running callback returns
+};
+
+static pthread_mutex_t tmr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tmr_cond;
+static pthread_once_t tmr_once = PTHREAD_ONCE_INIT;
+static int tmr_ok;
+static TMR_LINK tmr_wheel[TMR_LEVELS][TMR_SLOTS];
+static unsigned long long tmr_jiffies;  // next tick to process
+static unsigned long long tmr_base;  // os_get_nsec_clock at tick 0
+static unsigned long long tmr_wake;  // tick the timer thread sleeps until
+static int tmr_armed;
+static OS_TIMER *tmr_running;
+
+static unsigned long long tmr_now(void)
+{
+    return (os_get_nsec_clock() - tmr_base) / 1000000;
+}
+
+static void tmr_list_init(TMR_LINK *l)
+{
+    l->next = l->prev = l;
+}
+
+static void tmr_list_add(TMR_LINK *l, TMR_LINK *n)
+{
+    n->next = l;
+    n->prev = l->prev;
+    l->prev->next = n;
+    l->prev = n;
+}
+
+static void tmr_list_del(TMR_LINK *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    tmr_list_init(n);
+}
+
+static void tmr_insert(OS_TIMER *t)
+{
+    unsigned long long delta = t->expires > tmr_jiffies ? t->expires - tmr_jiffies : 0;
+    unsigned long long e = t->expires > tmr_jiffies ? t->expires : tmr_jiffies;
+    int level = 0;
+
+    while (level < TMR_LEVELS - 1 && delta >= (1ULL << (TMR_BITS * (level + 1))))
+        level++;
+    tmr_list_add(&tmr_wheel[level][(e >> (TMR_BITS * level)) & TMR_MASK], &t->link);
+}
+
+// Move the timers of the current slot of wheel level to the wheels below
+static void tmr_cascade(int level)
+{
+    TMR_LINK *slot = &tmr_wheel[level][(tmr_jiffies >> (TMR_BITS * level)) & TMR_MASK];
+    TMR_LINK list;
+
+    if (slot->next == slot)
+        return;
+    tmr_list_init(&list);
+    tmr_list_add(slot->next, &list);  // take over the whole chain
+    tmr_list_del(slot);
+    while (list.next != &list)
+    {
+        OS_TIMER *t = (OS_TIMER *)list.next;
+        tmr_list_del(&t->link);
+        tmr_insert(t);
+    }
+}
+
+static void tmr_fire(OS_TIMER *t)
+{
+    tmr_running = t;
+    pthread_mutex_unlock(&tmr_mutex);
+    if (t->func)
+        t->func(t->arg);
+    else
+        io_write(t->id, t->msg, t->len);
+    pthread_mutex_lock(&tmr_mutex);
+    tmr_running = NULL;
+    if (t->deleted)
+    {
+        free(t->msg);
+        free(t);
+    }
+}
+
+// Process tick tmr_jiffies, called with tmr_mutex held
+static void tmr_tick(void)
+{
+    TMR_LINK *slot;
+    TMR_LINK list;
+    int level;
+
+    for (level = 1; level < TMR_LEVELS && ((tmr_jiffies >> (TMR_BITS * (level - 1))) & TMR_MASK) == 0; level++)
+        tmr_cascade(level);
+    slot = &tmr_wheel[0][tmr_jiffies & TMR_MASK];
+    tmr_jiffies++;
+    if (slot->next == slot)
+        return;
+    tmr_list_init(&list);
+    tmr_list_add(slot->next, &list);
+    tmr_list_del(slot);
+    // callbacks run unlocked, a timer stopped meanwhile simply leaves the list
+    while (list.next != &list)
+    {
+        OS_TIMER *t = (OS_TIMER *)list.next;
+        tmr_list_del(&t->link);
+        if (t->period)
+        {
+            t->expires += t->period;
+            tmr_insert(t);
+        }
+        else
+        {
+            t->armed = 0;
+            tmr_armed--;
+        }
+        tmr_fire(t);
+    }
+}
+
+// first tick with work, a non-empty level 0 slot or the next wrap of level 0
+static unsigned long long tmr_next(void)
+{
+    unsigned long long j;
+    for (j = tmr_jiffies; (j & TMR_MASK) || j == tmr_jiffies; j++)
+    {
+        if (tmr_wheel[0][j & TMR_MASK].next != &tmr_wheel[0][j & TMR_MASK])
+            return j;
+    }
+    return j;
+}
+
+static void *tmr_thread(void *p)
+{
+    struct timespec ts;
+    unsigned long long now, wake;
+
+    (void)p;
+    pthread_mutex_lock(&tmr_mutex);
+    for (;;)
+    {
+        now = tmr_now();
+        while (tmr_jiffies <= now)
+            tmr_tick();
+        if (tmr_armed == 0)
+        {
+            tmr_wake = ~0ULL;
+            pthread_cond_wait(&tmr_cond, &tmr_mutex);
+            continue;
+        }
+        tmr_wake = tmr_next();
+        wake = tmr_base + tmr_wake * 1000000;
+        ts.tv_sec = wake / 1000000000ULL;
+        ts.tv_nsec = wake % 1000000000ULL;
+        pthread_cond_timedwait(&tmr_cond, &tmr_mutex, &ts);
+    }
+    return 0;
+}
+
+static void tmr_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    int i, j;
+
+    for (i = 0; i < TMR_LEVELS; i++)
+        for (j = 0; j < TMR_SLOTS; j++)
+            tmr_list_init(&tmr_wheel[i][j]);
+    tmr_base = os_get_nsec_clock();
+    tmr_wake = ~0ULL;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&tmr_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&thread, NULL, tmr_thread, NULL) == 0)
+    {
+        pthread_detach(thread);
+        tmr_ok = 1;
+    }
+}
+
+static OS_TIMER *tmr_alloc(void)
+{
+    OS_TIMER *t;
+    pthread_once(&tmr_once, tmr_init);
+    if (!tmr_ok || (t = calloc(1, sizeof(*t))) == NULL)
+        return NULL;
+    tmr_list_init(&t->link);
+    return t;
+}
+
+// Timer calling func(arg) on the timer thread, func must not block
+OS_TIMER *os_timer_create(void (*func)(void *), void *arg)
+{
+    OS_TIMER *t;
+    if (func == NULL || (t = tmr_alloc()) == NULL)
+        return NULL;
+    t->func = func;
+    t->arg = arg;
+    return t;
+}
+
+// Timer writing a copy of msg to stream id, the stream should not block writers
+OS_TIMER *os_timer_create_io(short id, const void *msg, int len)
+{
+    OS_TIMER *t;
+    if (len <= 0 || (t = tmr_alloc()) == NULL)
+        return NULL;
+    if ((t->msg = malloc(len)) == NULL)
+    {
+        free(t);
+        return NULL;
+    }
+    memcpy(t->msg, msg, len);
+    t->id = id;
+    t->len = len;
+    return t;
+}
+
+// Arm t to expire after delay_ms and then every period_ms if that is > 0, restarts an armed timer
+int os_timer_start(OS_TIMER *t, int delay_ms, int period_ms)
+{
+    unsigned long long now;
+    if (t == NULL || delay_ms < 0 || period_ms < 0)
+        return IO_ERR;
+    pthread_mutex_lock(&tmr_mutex);
+    now = tmr_now();
+    if (tmr_armed == 0 && tmr_jiffies < now)
+        tmr_jiffies = now;  // nothing to process in between
+    if (t->armed)
+        tmr_list_del(&t->link);
+    else
+        tmr_armed++;
+    t->armed = 1;
+    t->period = (unsigned int)period_ms;
+    // due ticks are processed at once, a zero delay fires on the next one
+    t->expires = now + (delay_ms ? (unsigned long long)delay_ms : 1);
+    if (t->expires - tmr_jiffies > TMR_MAX_DELAY)
+        t->expires = tmr_jiffies + TMR_MAX_DELAY;
+    tmr_insert(t);
+    if (t->expires < tmr_wake)
+        pthread_cond_signal(&tmr_cond);
+    pthread_mutex_unlock(&tmr_mutex);
+    return IO_OK;
+}
+
+// Returns 1 if t was armed, its callback may still be running on the timer thread
+int os_timer_stop(OS_TIMER *t)
+{
+    int ret = 0;
+    if (t == NULL)
+        return IO_ERR;
+    pthread_mutex_lock(&tmr_mutex);
+    if (t->armed)
+    {
+        tmr_list_del(&t->link);
+        t->armed = 0;
+        tmr_armed--;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&tmr_mutex);
+    return ret;
+}
+
+void os_timer_delete(OS_TIMER *t)
+{
+    if (t == NULL)
+        return;
+    os_timer_stop(t);
+    pthread_mutex_lock(&tmr_mutex);
+    if (tmr_running == t)
+    {
+        t->deleted = 1;
+        t = NULL;
+    }
+    pthread_mutex_unlock(&tmr_mutex);
+    if (t)
+    {
+        free(t->msg);
+        free(t);
+    }
+}
@@ -0,0 +1,221 @@
+/*
+ * trace.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "green.h"
+
+#define TRACE_MAX_RINGS 64
+#define TRACE_RING_LEN 0x4000  // records, power of two
+#define TRACE_GREEN_TID 0x40000000  // green tasks move between workers, their events get a tid of their own
+
+// Per-thread flight recorder, the oldest records are overwritten
+typedef struct
+{
+    volatile unsigned long long head;
+    int tid;
+    char name[16];
+    TRACE_REC rec[TRACE_RING_LEN];
+} TRACE_RING;
+
+volatile int os_trace_on;
+
+static TRACE_RING *volatile trace_rings[TRACE_MAX_RINGS];
+static volatile int trace_ring_num;
+
+// names of the green tasks started while tracing, by green_task_id
+static pthread_mutex_t trace_task_lock = PTHREAD_MUTEX_INITIALIZER;
+static char (*trace_task_names)[16];
+static int trace_task_num;
+
+static __thread TRACE_RING *trace_ring;
+static __thread int trace_no_ring;
+
+static const struct
+{
+    const char *name;
+    char ph;  // Chrome trace phase: B begin, E end, i instant
+} trace_names[TRACE_EVENT_NUM] = {
+    [TRACE_TASK_START] = {"task start", 'i'},
+    [TRACE_TASK_STOP] = {"task stop", 'i'},
+    [TRACE_TASK_OVERRUN] = {"task overrun", 'i'},
+    [TRACE_SEM_WAIT] = {"sem wait", 'B'},
+    [TRACE_SEM_WAKE] = {"sem wait", 'E'},
+    [TRACE_SEM_POST] = {"sem post", 'i'},
+    [TRACE_IO_READ] = {"io_read", 'B'},
+    [TRACE_IO_READ_END] = {"io_read", 'E'},
+    [TRACE_IO_WRITE] = {"io_write", 'B'},
+    [TRACE_IO_WRITE_END] = {"io_write", 'E'},
+    [TRACE_IO_SELECT] = {"io_select", 'B'},
+    [TRACE_IO_SELECT_END] = {"io_select", 'E'},
+    [TRACE_IO_DROP] = {"io drop", 'i'},
+};
+
+static TRACE_RING *trace_get_ring(void)
+{
+    TRACE_RING *r;
+    int n;
+
+    if (trace_ring || trace_no_ring)
+        return trace_ring;
+    trace_no_ring = 1;
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    if ((n = __atomic_fetch_add(&trace_ring_num, 1, __ATOMIC_RELAXED)) >= TRACE_MAX_RINGS)
+    {
+        free(r);
+        return NULL;
+    }
+    r->tid = (int)syscall(SYS_gettid);
+    strncpy(r->name, green_task_id() ? "green worker" : os_get_cur_task_name(), sizeof(r->name) - 1);
+    __atomic_store_n(&trace_rings[n], r, __ATOMIC_RELEASE);
+    trace_ring = r;
+    return r;
+}
+
+static void trace_task_name(int task)
+{
+    pthread_mutex_lock(&trace_task_lock);
+    if (task >= trace_task_num)
+    {
+        int num = task + 256;
+        char(*p)[16] = realloc(trace_task_names, num * sizeof(*p));
+        if (p)
+        {
+            memset(p + trace_task_num, 0, (num - trace_task_num) * sizeof(*p));
+            trace_task_names = p;
+            trace_task_num = num;
+        }
+    }
+    if (task < trace_task_num)
+        strncpy(trace_task_names[task], os_get_cur_task_name(), sizeof(trace_task_names[task]) - 1);
+    pthread_mutex_unlock(&trace_task_lock);
+}
+
+void os_trace_event(unsigned short type, short id, unsigned long long arg, int val)
+{
+    TRACE_RING *r = trace_get_ring();
+    TRACE_REC *p;
+    if (r == NULL)
+        return;
+    p = &r->rec[r->head & (TRACE_RING_LEN - 1)];
+    p->ts = os_get_nsec_clock();
+    p->arg = arg;
+    p->type = type;
+    p->id = id;
+    p->val = val;
+    p->task = green_task_id();
+    if (p->task && type == TRACE_TASK_START)
+        trace_task_name(p->task);
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void os_trace_enable(int on)
+{
+    __atomic_store_n(&os_trace_on, on, __ATOMIC_RELAXED);
+}
+
+// JSON string contents, task names may hold any character
+static void trace_put_str(FILE *f, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, f);
+    }
+}
+
+static void trace_put_thread(FILE *f, int tid, const char *name)
+{
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"", tid);
+    trace_put_str(f, name);
+    fprintf(f, "\"}}");
+}
+
+// Write the recorded events as Chrome trace JSON, returns the number of records or -1.
+// Records of threads still tracing may be overwritten while they are written out.
+int os_trace_dump(const char *path)
+{
+    FILE *f;
+    int i, n, tid, cnt = 0;
+    unsigned long long k, head;
+    unsigned char *seen = NULL;  // bitmap of the green tasks named so far
+    int seen_len = 0;
+    char name[16];
+
+    if ((f = fopen(path, "w")) == NULL)
+        return -1;
+    fprintf(f, "{\"traceEvents\":[\n");
+    n = __atomic_load_n(&trace_ring_num, __ATOMIC_ACQUIRE);
+    if (n > TRACE_MAX_RINGS)
+        n = TRACE_MAX_RINGS;
+    for (i = 0; i < n; i++)
+    {
+        TRACE_RING *r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+        if (r == NULL)
+            continue;
+        if (cnt)
+            fprintf(f, ",\n");
+        trace_put_thread(f, r->tid, r->name[0] ? r->name : "main");
+        cnt++;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (k = head > TRACE_RING_LEN ? head - TRACE_RING_LEN : 0; k < head; k++)
+        {
+            const TRACE_REC *p = &r->rec[k & (TRACE_RING_LEN - 1)];
+            if (p->type >= TRACE_EVENT_NUM)
+                continue;
+            tid = r->tid;
+            if (p->task > 0)
+            {
+                tid = TRACE_GREEN_TID + p->task;
+                if (p->task >= seen_len * 8)
+                {
+                    int len = p->task / 8 + 64;
+                    unsigned char *q = realloc(seen, len);
+                    if (q)
+                    {
+                        memset(q + seen_len, 0, len - seen_len);
+                        seen = q;
+                        seen_len = len;
+                    }
+                }
+                if (p->task < seen_len * 8 && !(seen[p->task / 8] & 1 << p->task % 8))
+                {
+                    seen[p->task / 8] |= 1 << p->task % 8;
+                    name[0] = 0;
+                    pthread_mutex_lock(&trace_task_lock);
+                    if (p->task < trace_task_num)
+                        memcpy(name, trace_task_names[p->task], sizeof(name));
+                    pthread_mutex_unlock(&trace_task_lock);
+                    if (name[0] == 0)
+                        snprintf(name, sizeof(name), "green %d", p->task);
+                    fprintf(f, ",\n");
+                    trace_put_thread(f, tid, name);
+                }
+            }
+            fprintf(f,
+                    ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%llu.%03u%s,"
+                    "\"args\":{\"id\":%d,\"arg\":\"0x%llx\",\"val\":%d}}",
+                    trace_names[p->type].ph, trace_names[p->type].name, tid, p->ts / 1000,
+                    (unsigned int)(p->ts % 1000), trace_names[p->type].ph == 'i' ? ",\"s\":\"t\"" : "", p->id,
+                    p->arg, p->val);
+            cnt++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    free(seen);
+    return cnt;
+}
@@ -0,0 +1,57 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include "rtos.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+enum TRACE_EVENT
+{
+    TRACE_TASK_START,
+    TRACE_TASK_STOP,
+    TRACE_TASK_OVERRUN,  // val is the number of releases missed
+    TRACE_SEM_WAIT,  // begin, arg is the semaphore
+    TRACE_SEM_WAKE,  // end of TRACE_SEM_WAIT, val is the result
+    TRACE_SEM_POST,
+    TRACE_IO_READ,  // begin, val is the length
+    TRACE_IO_READ_END,  // val is the result
+    TRACE_IO_WRITE,
+    TRACE_IO_WRITE_END,
+    TRACE_IO_SELECT,
+    TRACE_IO_SELECT_END,
+    TRACE_IO_DROP,  // write rejected for lack of space
+    TRACE_EVENT_NUM
+};
+
+typedef struct
+{
+    unsigned long long ts;  // os_get_nsec_clock
+    unsigned long long arg;
+    unsigned short type;
+    short id;
+    int val;
+    int task;  // green_task_id of the recording task, 0 for a thread
+} TRACE_REC;
+
+extern volatile int os_trace_on;
+
+void os_trace_event(unsigned short type, short id, unsigned long long arg, int val);
+
+// the only cost while tracing is off is the test of os_trace_on
+#define OS_TRACE(type, id, arg, val)                                                    \
+    do                                                                                  \
+    {                                                                                   \
+        if (__builtin_expect(os_trace_on, 0))                                           \
+            os_trace_event((type), (id), (unsigned long long)(uintptr_t)(arg), (val)); \
+    }                                                                                   \
+    while (0)
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // _TRACE_H_